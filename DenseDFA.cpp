@@ -0,0 +1,278 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+
+#include "FSA.cpp"
+
+// Read-only view of a dense transition table, wherever its arrays are stored.
+struct DFAView
+{
+    const uint32_t *next;
+    const uint64_t *finalBits;
+    const uint8_t *byteClass;
+    uint32_t columns;
+    uint32_t stateCount;
+    uint32_t initial;
+    // the patterns accepted by state q of a multi-pattern DFA are
+    // acceptTags[acceptStart[q] .. acceptStart[q + 1]), both are null otherwise
+    const uint32_t *acceptStart = nullptr;
+    const uint32_t *acceptTags = nullptr;
+};
+
+// Compiled form of a minimized FSA: contiguous state IDs, a row-major
+// next[state * alphabetSize + class] table with one column per byte class
+// and a bitmap of final states. State 0 is the implicit sink of the FSA,
+// every missing transition leads there; it is final when the sink accepts.
+//
+// The order of the other states decides which rows share cache lines, so
+// the states a scan visits most should be numbered next to each other.
+class DenseDFA
+{
+public:
+    // BreadthFirst and DepthFirst number the states in the order a search from the initial state
+    // discovers them; HotFirst puts the states with the most bytes leading into them first
+    enum class Layout
+    {
+        BreadthFirst,
+        DepthFirst,
+        HotFirst
+    };
+
+private:
+    uint32_t initialState;
+    uint32_t stateCount;
+    uint32_t alphabetSize;
+
+    std::array<uint8_t, 256> byteClass;
+    std::vector<uint32_t> next;
+    std::vector<uint64_t> finalBits;
+    std::vector<uint32_t> acceptStart;
+    std::vector<uint32_t> acceptTags;
+
+    void renumber(const std::vector<uint32_t> &order);
+
+public:
+    static constexpr uint32_t DEAD_STATE = 0;
+
+    explicit DenseDFA(const FSA &dfa, Layout layout = Layout::BreadthFirst);
+
+    // Renumbers the states by decreasing visits[state], as counted by Matcher::profile over a
+    // sample of the input, so the hottest rows share the first cache lines; ties keep their order.
+    // Views and matchers taken before are invalidated.
+    void reorder(const std::vector<uint64_t> &visits);
+
+    uint32_t initial() const { return initialState; }
+    uint32_t size() const { return stateCount; }
+    uint32_t columns() const { return alphabetSize; }
+
+    uint32_t step(uint32_t state, unsigned char byte) const
+    {
+        return next[static_cast<size_t>(state) * alphabetSize + byteClass[byte]];
+    }
+
+    bool isFinal(uint32_t state) const
+    {
+        return (finalBits[state >> 6] >> (state & 63)) & 1;
+    }
+
+    DFAView view() const;
+    size_t memoryUsage() const;
+};
+
+DenseDFA::DenseDFA(const FSA &dfa, Layout layout) : initialState(1), stateCount(0), alphabetSize(0)
+{
+    for (const auto &[fromState, symbolToStates] : dfa.transitions)
+    {
+        for (const auto &[symbol, toStates] : symbolToStates)
+        {
+            if (symbol == EPSILON || toStates.size() > 1)
+            {
+                throw std::runtime_error("DenseDFA requires a deterministic automaton");
+            }
+        }
+    }
+
+    // class 0 collects every byte the automaton has no transition on
+    ByteClasses classes = dfa.symbolClasses();
+    byteClass = classes.classOf;
+    alphabetSize = static_cast<uint32_t>(classes.size());
+
+    // number the reachable states in BFS order, starting right after the dead state; the successors
+    // of a state are visited in increasing class order, so the numbering does not depend on how
+    // the transition maps happen to iterate
+    constexpr size_t NO_STATE = SIZE_MAX;
+    std::unordered_map<size_t, uint32_t> stateID;
+    std::vector<size_t> order;
+    std::vector<size_t> successor(alphabetSize, NO_STATE);
+    std::queue<size_t> FSAQueue;
+
+    stateID[dfa.initialState] = 1;
+    order.push_back(dfa.initialState);
+    FSAQueue.push(dfa.initialState);
+
+    while (!FSAQueue.empty())
+    {
+        size_t state = FSAQueue.front();
+        FSAQueue.pop();
+
+        auto it = dfa.transitions.find(state);
+        if (it == dfa.transitions.end())
+        {
+            continue;
+        }
+        for (const auto &[symbol, toStates] : it->second)
+        {
+            successor[byteClass[static_cast<unsigned char>(symbol)]] = *toStates.begin();
+        }
+        for (size_t &toState : successor)
+        {
+            if (toState != NO_STATE && stateID.emplace(toState, static_cast<uint32_t>(order.size() + 1)).second)
+            {
+                order.push_back(toState);
+                FSAQueue.push(toState);
+            }
+            toState = NO_STATE;
+        }
+    }
+
+    stateCount = static_cast<uint32_t>(order.size() + 1);
+    next.assign(static_cast<size_t>(stateCount) * alphabetSize, DEAD_STATE);
+    finalBits.assign((stateCount + 63) / 64, 0);
+    finalBits[0] = dfa.sinkFinal;
+
+    if (dfa.multiPattern)
+    {
+        acceptStart.assign(stateCount + 1, 0);
+    }
+    for (uint32_t id = 1; id < stateCount; id++)
+    {
+        size_t state = order[id - 1];
+        if (dfa.finalStates.count(state))
+        {
+            finalBits[id >> 6] |= uint64_t(1) << (id & 63);
+        }
+        if (!acceptStart.empty())
+        {
+            auto tags = dfa.acceptTags.find(state);
+            if (tags != dfa.acceptTags.end() && dfa.finalStates.count(state))
+            {
+                acceptTags.insert(acceptTags.end(), tags->second.begin(), tags->second.end());
+            }
+            acceptStart[id + 1] = static_cast<uint32_t>(acceptTags.size());
+        }
+
+        auto it = dfa.transitions.find(state);
+        if (it == dfa.transitions.end())
+        {
+            continue;
+        }
+        for (const auto &[symbol, toStates] : it->second)
+        {
+            next[static_cast<size_t>(id) * alphabetSize + byteClass[static_cast<unsigned char>(symbol)]] = stateID[*toStates.begin()];
+        }
+    }
+
+    if (layout == Layout::DepthFirst)
+    {
+        std::vector<uint32_t> order{DEAD_STATE};
+        std::vector<bool> seen(stateCount, false);
+        std::vector<uint32_t> stack{initialState};
+        seen[DEAD_STATE] = seen[initialState] = true;
+        while (!stack.empty())
+        {
+            uint32_t state = stack.back();
+            stack.pop_back();
+            order.push_back(state);
+            // pushed in reverse so that the lowest class is explored first
+            for (uint32_t column = alphabetSize; column-- > 0;)
+            {
+                uint32_t toState = next[static_cast<size_t>(state) * alphabetSize + column];
+                if (!seen[toState])
+                {
+                    seen[toState] = true;
+                    stack.push_back(toState);
+                }
+            }
+        }
+        renumber(order);
+    }
+    else if (layout == Layout::HotFirst)
+    {
+        // a static guess at the visits: how many (state, byte) pairs lead into each state
+        std::vector<uint32_t> width(alphabetSize, 0);
+        for (size_t byte = 0; byte < 256; byte++)
+        {
+            width[byteClass[byte]]++;
+        }
+        std::vector<uint64_t> incoming(stateCount, 0);
+        for (size_t cell = alphabetSize; cell < next.size(); cell++)
+        {
+            incoming[next[cell]] += width[cell % alphabetSize];
+        }
+        reorder(incoming);
+    }
+}
+
+void DenseDFA::reorder(const std::vector<uint64_t> &visits)
+{
+    std::vector<uint32_t> order(stateCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin() + 1, order.end(), [&visits](uint32_t a, uint32_t b)
+                     { return (a < visits.size() ? visits[a] : 0) > (b < visits.size() ? visits[b] : 0); });
+    renumber(order);
+}
+
+// gives state order[i] the ID i; order[0] must be the dead state
+void DenseDFA::renumber(const std::vector<uint32_t> &order)
+{
+    std::vector<uint32_t> idOf(stateCount);
+    for (uint32_t id = 0; id < stateCount; id++)
+    {
+        idOf[order[id]] = id;
+    }
+
+    std::vector<uint32_t> newNext(next.size());
+    std::vector<uint64_t> newFinalBits(finalBits.size(), 0);
+    std::vector<uint32_t> newAcceptStart, newAcceptTags;
+    if (!acceptStart.empty())
+    {
+        newAcceptStart.assign(stateCount + 1, 0);
+    }
+    for (uint32_t id = 0; id < stateCount; id++)
+    {
+        uint32_t state = order[id];
+        const uint32_t *row = next.data() + static_cast<size_t>(state) * alphabetSize;
+        for (uint32_t column = 0; column < alphabetSize; column++)
+        {
+            newNext[static_cast<size_t>(id) * alphabetSize + column] = idOf[row[column]];
+        }
+        newFinalBits[id >> 6] |= static_cast<uint64_t>(isFinal(state)) << (id & 63);
+        if (!acceptStart.empty())
+        {
+            newAcceptTags.insert(newAcceptTags.end(), acceptTags.begin() + acceptStart[state],
+                                 acceptTags.begin() + acceptStart[state + 1]);
+            newAcceptStart[id + 1] = static_cast<uint32_t>(newAcceptTags.size());
+        }
+    }
+
+    initialState = idOf[initialState];
+    next = std::move(newNext);
+    finalBits = std::move(newFinalBits);
+    acceptStart = std::move(newAcceptStart);
+    acceptTags = std::move(newAcceptTags);
+}
+
+DFAView DenseDFA::view() const
+{
+    return {next.data(), finalBits.data(), byteClass.data(), alphabetSize, stateCount, initialState,
+            acceptStart.empty() ? nullptr : acceptStart.data(), acceptStart.empty() ? nullptr : acceptTags.data()};
+}
+
+size_t DenseDFA::memoryUsage() const
+{
+    return sizeof(*this) + next.size() * sizeof(uint32_t) + finalBits.size() * sizeof(uint64_t) +
+           (acceptStart.size() + acceptTags.size()) * sizeof(uint32_t);
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "RegexAST.cpp"
+
+// Hash-consed expressions in the normal form used for Brzozowski derivatives, so two terms
+// denote the same normalized expression exactly when their IDs are equal. The smart constructors
+// flatten, sort and deduplicate unions and intersections into right-nested chains, right-nest
+// concatenations and apply the identities of the empty language, the empty word and the complement
+// of the empty language. Under these rules the derivatives of a term take finitely many forms.
+//
+// Symbols are numbered per expression: class 0 stands for every byte the expression does not
+// mention, so complements still range over all bytes.
+class RegexTerms
+{
+public:
+    enum class Kind : uint8_t
+    {
+        Empty,
+        EmptyWord,
+        Symbol,
+        Concatenation,
+        Star,
+        Union,
+        Intersection,
+        Complement
+    };
+
+    struct Term
+    {
+        Kind kind;
+        uint8_t symbol;
+        bool nullable;
+        uint32_t left;
+        uint32_t right;
+
+        bool operator==(const Term &other) const
+        {
+            return kind == other.kind && symbol == other.symbol && left == other.left && right == other.right;
+        }
+    };
+
+    static constexpr uint32_t NONE = UINT32_MAX;
+    // the empty language, the empty word and every word
+    static constexpr uint32_t NOTHING = 0, EMPTY_WORD = 1, ANYTHING = 2;
+
+private:
+    struct TermHash
+    {
+        std::size_t operator()(const Term &term) const
+        {
+            uint64_t h = (static_cast<uint64_t>(term.kind) << 8 | term.symbol) * 0x9E3779B97F4A7C15ull;
+            h = (h ^ term.left) * 0xFF51AFD7ED558CCDull;
+            h = (h ^ term.right) * 0xC4CEB9FE1A85EC53ull;
+            return h ^ (h >> 32);
+        }
+    };
+
+    std::vector<Term> terms;
+    std::unordered_map<Term, uint32_t, TermHash> interned;
+    // derivative of term t by class c under the key t << 8 | c
+    std::unordered_map<uint64_t, uint32_t> derivatives;
+    std::vector<uint32_t> operands;
+
+    uint32_t intern(Kind kind, uint8_t symbol, uint32_t left, uint32_t right, bool nullable);
+    uint32_t combine(Kind kind, uint32_t a, uint32_t b);
+    uint32_t translate(const RegexAST &ast, uint32_t node, bool reversed, uint32_t tail,
+                       std::unordered_map<uint64_t, uint32_t> &translated);
+
+public:
+    std::array<uint8_t, 256> classOf;
+    size_t classes;
+
+    // numbers the symbols of ast in order of appearance
+    explicit RegexTerms(const RegexAST &ast);
+
+    size_t size() const { return terms.size(); }
+    bool nullable(uint32_t term) const { return terms[term].nullable; }
+
+    uint32_t symbol(uint8_t cls) { return intern(Kind::Symbol, cls, NONE, NONE, false); }
+    uint32_t concatenation(uint32_t a, uint32_t b);
+    uint32_t star(uint32_t a);
+    uint32_t alternative(uint32_t a, uint32_t b) { return combine(Kind::Union, a, b); }
+    uint32_t intersection(uint32_t a, uint32_t b) { return combine(Kind::Intersection, a, b); }
+    uint32_t complement(uint32_t a);
+
+    // the term of the whole expression; reversal is pushed down to the symbols while translating
+    uint32_t fromAST(const RegexAST &ast);
+    uint32_t derivative(uint32_t term, uint8_t cls);
+};
+
+RegexTerms::RegexTerms(const RegexAST &ast) : classes(1)
+{
+    classOf.fill(0);
+    for (const auto &node : ast.nodes)
+    {
+        unsigned char byte = static_cast<unsigned char>(node.symbol);
+        if (node.op == 0 && classOf[byte] == 0)
+        {
+            classOf[byte] = static_cast<uint8_t>(classes++);
+        }
+    }
+
+    intern(Kind::Empty, 0, NONE, NONE, false);
+    intern(Kind::EmptyWord, 0, NONE, NONE, true);
+    intern(Kind::Complement, 0, NOTHING, NONE, true);
+}
+
+uint32_t RegexTerms::intern(Kind kind, uint8_t symbol, uint32_t left, uint32_t right, bool nullable)
+{
+    Term term{kind, symbol, nullable, left, right};
+    auto [match, inserted] = interned.try_emplace(term, static_cast<uint32_t>(terms.size()));
+    if (inserted)
+    {
+        terms.push_back(term);
+        FSA_METRIC_ADD(derivativeTerms, 1);
+    }
+    return match->second;
+}
+
+// the operands of both sides are merged into one sorted chain without duplicates
+uint32_t RegexTerms::combine(Kind kind, uint32_t a, uint32_t b)
+{
+    bool isUnion = kind == Kind::Union;
+    uint32_t absorbing = isUnion ? ANYTHING : NOTHING;
+    uint32_t neutral = isUnion ? NOTHING : ANYTHING;
+    if (a == absorbing || b == absorbing)
+    {
+        return absorbing;
+    }
+    if (a == b || b == neutral)
+    {
+        return a;
+    }
+    if (a == neutral)
+    {
+        return b;
+    }
+
+    size_t base = operands.size();
+    for (uint32_t side : {a, b})
+    {
+        for (; terms[side].kind == kind; side = terms[side].right)
+        {
+            operands.push_back(terms[side].left);
+        }
+        operands.push_back(side);
+    }
+    std::sort(operands.begin() + base, operands.end());
+    operands.erase(std::unique(operands.begin() + base, operands.end()), operands.end());
+
+    uint32_t result = operands.back();
+    for (size_t i = operands.size() - 1; i-- > base;)
+    {
+        bool nullable = isUnion ? terms[operands[i]].nullable || terms[result].nullable
+                                : terms[operands[i]].nullable && terms[result].nullable;
+        result = intern(kind, 0, operands[i], result, nullable);
+    }
+    operands.resize(base);
+    return result;
+}
+
+uint32_t RegexTerms::concatenation(uint32_t a, uint32_t b)
+{
+    if (a == NOTHING || b == NOTHING)
+    {
+        return NOTHING;
+    }
+    if (a == EMPTY_WORD)
+    {
+        return b;
+    }
+    if (b == EMPTY_WORD)
+    {
+        return a;
+    }
+    Term first = terms[a];
+    if (first.kind == Kind::Concatenation)
+    {
+        return concatenation(first.left, concatenation(first.right, b));
+    }
+    // distributing over a union keeps derivatives sums of concatenations, which the union
+    // normalizes; (e|x)y and y|xy would otherwise become distinct states
+    if (first.kind == Kind::Union)
+    {
+        return alternative(concatenation(first.left, b), concatenation(first.right, b));
+    }
+    return intern(Kind::Concatenation, 0, a, b, first.nullable && terms[b].nullable);
+}
+
+uint32_t RegexTerms::star(uint32_t a)
+{
+    if (a == NOTHING || a == EMPTY_WORD)
+    {
+        return EMPTY_WORD;
+    }
+    if (terms[a].kind == Kind::Star)
+    {
+        return a;
+    }
+    return intern(Kind::Star, 0, a, NONE, true);
+}
+
+uint32_t RegexTerms::complement(uint32_t a)
+{
+    if (terms[a].kind == Kind::Complement)
+    {
+        return terms[a].left;
+    }
+    return intern(Kind::Complement, 0, a, NONE, !terms[a].nullable);
+}
+
+uint32_t RegexTerms::fromAST(const RegexAST &ast)
+{
+    std::unordered_map<uint64_t, uint32_t> translated;
+    return translate(ast, ast.root, false, EMPTY_WORD, translated);
+}
+
+// Returns the term of node (reversed if asked) followed by tail. Passing the rest of a
+// concatenation down as the tail builds it right-nested in one pass; the other operators are
+// translated once per direction and then prefixed to the tail.
+uint32_t RegexTerms::translate(const RegexAST &ast, uint32_t node, bool reversed, uint32_t tail,
+                               std::unordered_map<uint64_t, uint32_t> &translated)
+{
+    const RegexNode &current = ast.nodes[node];
+    switch (current.op)
+    {
+    case 0:
+        return concatenation(symbol(classOf[static_cast<unsigned char>(current.symbol)]), tail);
+    case '&':
+        if (reversed)
+        {
+            return translate(ast, current.right, true, translate(ast, current.left, true, tail, translated), translated);
+        }
+        return translate(ast, current.left, false, translate(ast, current.right, false, tail, translated), translated);
+    case '^':
+        return translate(ast, current.left, !reversed, tail, translated);
+    }
+
+    uint64_t key = static_cast<uint64_t>(node) << 1 | reversed;
+    auto found = translated.find(key);
+    if (found != translated.end())
+    {
+        return concatenation(found->second, tail);
+    }
+
+    uint32_t left = translate(ast, current.left, reversed, EMPTY_WORD, translated);
+    uint32_t result;
+    switch (current.op)
+    {
+    case '*':
+        result = star(left);
+        break;
+    case '~':
+        result = complement(left);
+        break;
+    case '|':
+        result = alternative(left, translate(ast, current.right, reversed, EMPTY_WORD, translated));
+        break;
+    case '%':
+        result = intersection(left, translate(ast, current.right, reversed, EMPTY_WORD, translated));
+        break;
+    case '-':
+        result = intersection(left, complement(translate(ast, current.right, reversed, EMPTY_WORD, translated)));
+        break;
+    default:
+        throw std::runtime_error("Unknown operator: " + std::string(1, current.op));
+    }
+    translated.emplace(key, result);
+    return concatenation(result, tail);
+}
+
+uint32_t RegexTerms::derivative(uint32_t term, uint8_t cls)
+{
+    uint64_t key = static_cast<uint64_t>(term) << 8 | cls;
+    auto found = derivatives.find(key);
+    if (found != derivatives.end())
+    {
+        return found->second;
+    }
+    FSA_METRIC_ADD(derivatives, 1);
+
+    Term current = terms[term];
+    uint32_t result = NOTHING;
+    switch (current.kind)
+    {
+    case Kind::Empty:
+    case Kind::EmptyWord:
+        break;
+    case Kind::Symbol:
+        result = current.symbol == cls ? EMPTY_WORD : NOTHING;
+        break;
+    case Kind::Concatenation:
+        result = concatenation(derivative(current.left, cls), current.right);
+        if (terms[current.left].nullable)
+        {
+            result = alternative(result, derivative(current.right, cls));
+        }
+        break;
+    case Kind::Star:
+        result = concatenation(derivative(current.left, cls), term);
+        break;
+    case Kind::Union:
+        result = alternative(derivative(current.left, cls), derivative(current.right, cls));
+        break;
+    case Kind::Intersection:
+        result = intersection(derivative(current.left, cls), derivative(current.right, cls));
+        break;
+    case Kind::Complement:
+        result = complement(derivative(current.left, cls));
+        break;
+    }
+    derivatives.emplace(key, result);
+    return result;
+}
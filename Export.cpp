@@ -0,0 +1,273 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Text exporters for FSA::write. A writer receives every transition, then every state, then the
+// accepting sink if there is one, and formats them into a buffer that reaches the stream in blocks
+// of BLOCK_SIZE bytes rather than one call per token. It counts what it was given, so the size of
+// an exported automaton is known without walking it again. Any class with the same four member
+// functions can be passed to FSA::write.
+class AutomatonWriter
+{
+private:
+    std::ostream &out;
+    std::string buffer;
+
+protected:
+    size_t writtenStates = 0;
+    size_t writtenTransitions = 0;
+
+    void put(char ch) { buffer += ch; }
+    void put(const char *text) { buffer += text; }
+
+    void put(size_t number)
+    {
+        char digits[24];
+        buffer.append(digits, std::to_chars(digits, digits + sizeof(digits), number).ptr);
+    }
+
+    void putHex(unsigned char byte)
+    {
+        static constexpr char hex[] = "0123456789abcdef";
+        buffer += hex[byte >> 4];
+        buffer += hex[byte & 15];
+    }
+
+    // called after every line, so the buffer stays within one block of its capacity
+    void endLine()
+    {
+        buffer += '\n';
+        if (buffer.size() >= BLOCK_SIZE)
+        {
+            flush();
+        }
+    }
+
+public:
+    static constexpr size_t BLOCK_SIZE = 1 << 16;
+
+    explicit AutomatonWriter(std::ostream &out) : out(out)
+    {
+        buffer.reserve(BLOCK_SIZE + 256);
+    }
+    AutomatonWriter(const AutomatonWriter &) = delete;
+    AutomatonWriter &operator=(const AutomatonWriter &) = delete;
+    ~AutomatonWriter() { flush(); }
+
+    size_t states() const { return writtenStates; }
+    size_t transitions() const { return writtenTransitions; }
+
+    void flush()
+    {
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+};
+
+// Mermaid flowchart, the format FSA::print has always produced. Labels list the bytes of the
+// transition's class separated by commas.
+class MermaidWriter : public AutomatonWriter
+{
+public:
+    explicit MermaidWriter(std::ostream &out) : AutomatonWriter(out)
+    {
+        put("flowchart LR\n");
+    }
+
+    // bytes are the members of the symbol class in increasing order, empty for an epsilon move
+    void transition(size_t from, size_t to, const std::string &bytes)
+    {
+        writtenTransitions++;
+        put('\t');
+        put(from);
+        if (bytes.empty())
+        {
+            put("-- ε -->");
+        }
+        else
+        {
+            put("-- ");
+            for (size_t i = 0; i < bytes.size(); i++)
+            {
+                if (i)
+                {
+                    put(',');
+                }
+                put(bytes[i]);
+            }
+            put(" -->");
+        }
+        put(to);
+        endLine();
+    }
+
+    void state(size_t state, bool initial, bool final)
+    {
+        writtenStates++;
+        put('\t');
+        put(state);
+        put(final ? "(((" : "((");
+        put(state);
+        put(final ? ")))" : initial ? " init))" : " ))");
+        endLine();
+    }
+
+    void sink()
+    {
+        put("\tsink(((sink)))");
+        endLine();
+    }
+
+    void end() { flush(); }
+};
+
+// Graphviz digraph; final states are double circles and an arrow from a point marks the initial one.
+class DotWriter : public AutomatonWriter
+{
+public:
+    explicit DotWriter(std::ostream &out) : AutomatonWriter(out)
+    {
+        put("digraph FSA {\n\trankdir=LR;\n\tnode [shape=circle];\n");
+    }
+
+    void transition(size_t from, size_t to, const std::string &bytes)
+    {
+        writtenTransitions++;
+        put('\t');
+        put(from);
+        put(" -> ");
+        put(to);
+        put(" [label=\"");
+        if (bytes.empty())
+        {
+            put("ε");
+        }
+        for (size_t i = 0; i < bytes.size(); i++)
+        {
+            unsigned char byte = static_cast<unsigned char>(bytes[i]);
+            if (i)
+            {
+                put(',');
+            }
+            if (byte == '"' || byte == '\\')
+            {
+                put('\\');
+                put(bytes[i]);
+            }
+            else if (byte < 0x20 || byte >= 0x7f)
+            {
+                put("\\\\x");
+                putHex(byte);
+            }
+            else
+            {
+                put(bytes[i]);
+            }
+        }
+        put("\"];");
+        endLine();
+    }
+
+    void state(size_t state, bool initial, bool final)
+    {
+        writtenStates++;
+        if (initial)
+        {
+            put("\tinit [shape=point];\n\tinit -> ");
+            put(state);
+            put(';');
+            endLine();
+        }
+        if (final)
+        {
+            put('\t');
+            put(state);
+            put(" [shape=doublecircle];");
+            endLine();
+        }
+    }
+
+    void sink()
+    {
+        put("\tsink [shape=doublecircle];");
+        endLine();
+    }
+
+    void end()
+    {
+        put('}');
+        endLine();
+        flush();
+    }
+};
+
+// One line per item: "i q" for the initial state, "f q" for each final state, "s" when missing
+// transitions lead to an accepting sink, and "from to bytes" for each transition, where bytes
+// lists the byte class as hex values and ranges (61-63,7a) and "e" stands for epsilon.
+class EdgeListWriter : public AutomatonWriter
+{
+public:
+    using AutomatonWriter::AutomatonWriter;
+
+    void transition(size_t from, size_t to, const std::string &bytes)
+    {
+        writtenTransitions++;
+        put(from);
+        put(' ');
+        put(to);
+        put(' ');
+        if (bytes.empty())
+        {
+            put('e');
+        }
+        for (size_t i = 0; i < bytes.size();)
+        {
+            size_t last = i;
+            while (last + 1 < bytes.size() &&
+                   static_cast<unsigned char>(bytes[last + 1]) == static_cast<unsigned char>(bytes[last]) + 1)
+            {
+                last++;
+            }
+            if (i)
+            {
+                put(',');
+            }
+            putHex(static_cast<unsigned char>(bytes[i]));
+            if (last != i)
+            {
+                put('-');
+                putHex(static_cast<unsigned char>(bytes[last]));
+            }
+            i = last + 1;
+        }
+        endLine();
+    }
+
+    void state(size_t state, bool initial, bool final)
+    {
+        writtenStates++;
+        if (initial)
+        {
+            put("i ");
+            put(state);
+            endLine();
+        }
+        if (final)
+        {
+            put("f ");
+            put(state);
+            endLine();
+        }
+    }
+
+    void sink()
+    {
+        put('s');
+        endLine();
+    }
+
+    void end() { flush(); }
+};
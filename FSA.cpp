@@ -1,3 +1,5 @@
+#pragma once
+
 #include <unordered_map>
 #include <string>
 #include <iostream>
@@ -5,1109 +7,3031 @@
 #include <queue>
 #include <stack>
 #include <set>
+#include <map>
 #include <unordered_set>
-#include <chrono>
 #include <bitset>
 #include <algorithm>
 #include <list>
+#include <cstdint>
+#include <array>
+#include <memory>
+#include <memory_resource>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <optional>
+
+#include "RegexAST.cpp"
+#include "Derivatives.cpp"
+#include "Export.cpp"
 
 constexpr char EPSILON = '\0';
 
-struct StateSetHash
+// Interns sorted sets of dense state IDs. The sets are stored back to back in one array and
+// found again through an open-addressing table keyed by a 64-bit hash of their contents.
+struct StateSetArena
 {
-    std::size_t operator()(const std::unordered_set<size_t> &states) const
+    std::vector<uint32_t> members;
+    std::vector<uint32_t> start;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> slots;
+
+    StateSetArena() : start({0}), slots(1024, 0)
+    {
+    }
+
+    size_t size() const { return start.size() - 1; }
+
+    void clear()
+    {
+        members.clear();
+        start.assign(1, 0);
+        hashes.clear();
+        std::fill(slots.begin(), slots.end(), 0);
+    }
+
+    const uint32_t *begin(uint32_t id) const { return members.data() + start[id]; }
+    const uint32_t *end(uint32_t id) const { return members.data() + start[id + 1]; }
+
+    static uint64_t hash(const uint32_t *set, size_t length)
     {
-        std::size_t sum = 0;
-        for (const auto &state : states)
+        uint64_t h = 0x9E3779B97F4A7C15ull ^ length;
+        for (size_t i = 0; i < length; i++)
         {
-            sum += state * state;
+            h = (h ^ set[i]) * 0xFF51AFD7ED558CCDull;
+            h ^= h >> 32;
         }
-        return sum;
+        h ^= h >> 29;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        return h ^ (h >> 32);
     }
-};
 
-struct StateSetEqual
-{
-    bool operator()(const std::unordered_set<size_t> &lhs, const std::unordered_set<size_t> &rhs) const
+    // returns the ID of the set and whether it was added by this call
+    std::pair<uint32_t, bool> intern(const std::vector<uint32_t> &set)
     {
-        if (lhs.size() != rhs.size())
+        return intern(set, hash(set.data(), set.size()));
+    }
+
+    std::pair<uint32_t, bool> intern(const std::vector<uint32_t> &set, uint64_t h)
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t slot = h & mask;; slot = (slot + 1) & mask)
         {
-            return false;
+            if (slots[slot] == 0)
+            {
+                uint32_t id = static_cast<uint32_t>(size());
+                slots[slot] = id + 1;
+                hashes.push_back(h);
+                members.insert(members.end(), set.begin(), set.end());
+                start.push_back(static_cast<uint32_t>(members.size()));
+                if (2 * size() > slots.size())
+                {
+                    grow();
+                }
+                return {id, true};
+            }
+            uint32_t id = slots[slot] - 1;
+            if (hashes[id] == h && std::equal(set.begin(), set.end(), begin(id), end(id)))
+            {
+                return {id, false};
+            }
         }
+    }
 
-        for (const auto &state : lhs)
+    void grow()
+    {
+        slots.assign(slots.size() * 2, 0);
+        size_t mask = slots.size() - 1;
+        for (uint32_t id = 0; id < size(); id++)
         {
-            if (rhs.count(state) == 0)
+            size_t slot = hashes[id] & mask;
+            while (slots[slot] != 0)
             {
-                return false;
+                slot = (slot + 1) & mask;
             }
+            slots[slot] = id + 1;
         }
-
-        return true;
     }
 };
 
-class FSA
+struct StatePairHash
 {
-private:
-    size_t initialState;
-    std::unordered_set<size_t> states;
-    std::unordered_set<size_t> finalStates;
-    std::unordered_map<size_t, std::unordered_map<char, std::unordered_set<size_t>>> transitions;
-
-    static bool isSpecial(char ch);
-    static bool isOperator(char ch);
-    static int precedence(char op);
-    static void process_operator(std::stack<FSA *> &automatas, char op);
-
-    size_t nextState;
-    void copyTransitionsWithOffset(size_t offset, const FSA &copyFrom, std::unordered_map<size_t, size_t> &visited);
-    void copyTransitionsWithOffset(size_t offset, const FSA &copyFrom);
-
-    void unionWith(const FSA &other);
-    void concatenateWith(const FSA &other);
-    void kleene();
-    void reverse();
-
-    void complement();
-    void intersect(const FSA &other);
-    void difference(const FSA &other);
-
-    void determinize();
-    void minimize();
-
-    std::unordered_set<size_t> epsilonClosure(const std::unordered_set<size_t> &startStates) const;
-    void mergeStates(std::unordered_map<size_t, size_t> &partition);
-
-public:
-    FSA();
-    FSA(char symbol);
-    FSA(const FSA &other);
-    ~FSA();
-
-    void print() const;
-
-    static FSA *parseExpression(const std::string &expression);
+    std::size_t operator()(const std::pair<size_t, size_t> &pair) const
+    {
+        uint64_t h = (pair.first * 0x9E3779B97F4A7C15ull) ^ (pair.second + 0x632BE59BD9B4E019ull);
+        h ^= h >> 31;
+        h *= 0xFF51AFD7ED558CCDull;
+        return h ^ (h >> 29);
+    }
 };
 
-FSA::FSA() : initialState(0), states({0, 1}), finalStates({1}), nextState(2)
-{
-}
-
-FSA::FSA(char symbol) : initialState(0), states({0, 1}), finalStates({1}), nextState(2)
-{
-    transitions[0][symbol].insert(1);
-}
-
-FSA::FSA(const FSA &other) : initialState(other.initialState), finalStates(other.finalStates), nextState(other.nextState)
+// An FSA with its states renumbered 0..n-1, as used by the subset construction. It has no epsilon
+// moves: the symbol moves (sorted by symbol) of each state are stored in flat arrays and already
+// include those of every state its epsilon closure reaches.
+struct DenseNFA
 {
-    auto start = std::chrono::high_resolution_clock::now();
+    uint32_t initialState;
+    std::vector<bool> finalStates;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> acceptTags;
+    std::vector<uint32_t> moveStart;
+    std::vector<char> moveSymbols;
+    std::vector<uint32_t> moveTargets;
 
-    copyTransitionsWithOffset(0, other);
+    void removeEpsilons(const std::vector<uint32_t> &epsilonStart, const std::vector<uint32_t> &epsilonTargets);
 
-    auto end = std::chrono::high_resolution_clock::now();
-    std::cerr << "Copy FSA took: " << end.time_since_epoch().count() - start.time_since_epoch().count() << '\n';
-}
+    size_t size() const { return finalStates.size(); }
 
-FSA::~FSA()
-{
-    states.clear();
-    finalStates.clear();
-    transitions.clear();
-}
+    // the union of the tags of the final members of a subset, sorted
+    std::vector<uint32_t> tagsOf(const uint32_t *first, const uint32_t *last) const
+    {
+        std::vector<uint32_t> tags;
+        if (acceptTags.empty())
+        {
+            return tags;
+        }
+        for (const uint32_t *member = first; member != last; ++member)
+        {
+            auto it = acceptTags.find(*member);
+            if (it != acceptTags.end())
+            {
+                tags.insert(tags.end(), it->second.begin(), it->second.end());
+            }
+        }
+        std::sort(tags.begin(), tags.end());
+        tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+        return tags;
+    }
+};
 
-void FSA::print() const
+// Collapses every strongly connected component of the epsilon graph into one state, found with
+// Tarjan's algorithm, and gives it the moves, finality and tags of its whole closure. Tarjan
+// finishes a component after every component it reaches, so each closure is folded once from the
+// component's own moves and the folded moves of its epsilon successors. Only the components
+// reachable from the initial one by symbol moves are kept, numbered breadth-first.
+void DenseNFA::removeEpsilons(const std::vector<uint32_t> &epsilonStart, const std::vector<uint32_t> &epsilonTargets)
 {
-    std::cout << "flowchart LR\n";
+    constexpr uint32_t UNVISITED = UINT32_MAX;
+    uint32_t n = static_cast<uint32_t>(size());
+    std::vector<uint32_t> visitIndex(n, UNVISITED), lowLink(n), componentOf(n, UNVISITED);
+    std::vector<uint32_t> open, members;
+    std::vector<std::pair<uint32_t, uint32_t>> calls;
+    uint32_t visited = 0, components = 0;
+
+    // the folded closure of every component, its targets still states of the input
+    std::vector<uint32_t> foldStart{0};
+    std::vector<std::pair<char, uint32_t>> folded, moves;
+    std::vector<bool> foldedFinal;
+    std::vector<std::vector<uint32_t>> foldedTags;
+
+    auto finish = [&](uint32_t root)
+    {
+        members.clear();
+        uint32_t member;
+        do
+        {
+            member = open.back();
+            open.pop_back();
+            componentOf[member] = components;
+            members.push_back(member);
+        } while (member != root);
+
+        bool final = false;
+        std::vector<uint32_t> tags;
+        moves.clear();
+        for (uint32_t q : members)
+        {
+            final = final || finalStates[q];
+            auto it = acceptTags.find(q);
+            if (it != acceptTags.end())
+            {
+                tags.insert(tags.end(), it->second.begin(), it->second.end());
+            }
+            for (uint32_t j = moveStart[q]; j < moveStart[q + 1]; j++)
+            {
+                moves.emplace_back(moveSymbols[j], moveTargets[j]);
+            }
+            for (uint32_t i = epsilonStart[q]; i < epsilonStart[q + 1]; i++)
+            {
+                uint32_t successor = componentOf[epsilonTargets[i]];
+                if (successor == components)
+                {
+                    continue;
+                }
+                final = final || foldedFinal[successor];
+                if (!acceptTags.empty())
+                {
+                    tags.insert(tags.end(), foldedTags[successor].begin(), foldedTags[successor].end());
+                }
+                moves.insert(moves.end(), folded.begin() + foldStart[successor], folded.begin() + foldStart[successor + 1]);
+            }
+        }
+        std::sort(moves.begin(), moves.end());
+        moves.erase(std::unique(moves.begin(), moves.end()), moves.end());
+        folded.insert(folded.end(), moves.begin(), moves.end());
+        foldStart.push_back(static_cast<uint32_t>(folded.size()));
+        foldedFinal.push_back(final);
+        if (!acceptTags.empty())
+        {
+            std::sort(tags.begin(), tags.end());
+            tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+            foldedTags.push_back(std::move(tags));
+        }
+        components++;
+    };
 
-    size_t numberOfTransitions = 0;
-    for (const auto &[fromState, symbolToStates] : transitions)
+    for (uint32_t root = 0; root < n; root++)
     {
-        for (const auto &[symbol, toStates] : symbolToStates)
+        if (visitIndex[root] != UNVISITED)
         {
-            for (const auto &toState : toStates)
+            continue;
+        }
+        visitIndex[root] = lowLink[root] = visited++;
+        open.push_back(root);
+        calls.emplace_back(root, epsilonStart[root]);
+        while (!calls.empty())
+        {
+            auto [state, edge] = calls.back();
+            if (edge < epsilonStart[state + 1])
             {
-                ++numberOfTransitions;
-                if (symbol == EPSILON)
+                calls.back().second++;
+                uint32_t target = epsilonTargets[edge];
+                if (visitIndex[target] == UNVISITED)
                 {
-                    std::cout << "\t" << fromState << "-- ε -->" << toState << "\n";
+                    visitIndex[target] = lowLink[target] = visited++;
+                    open.push_back(target);
+                    calls.emplace_back(target, epsilonStart[target]);
                 }
-                else
+                else if (componentOf[target] == UNVISITED)
                 {
-                    std::cout << "\t" << fromState << "-- " << symbol << " -->" << toState << "\n";
+                    lowLink[state] = std::min(lowLink[state], visitIndex[target]);
                 }
+                continue;
+            }
+            calls.pop_back();
+            if (!calls.empty())
+            {
+                lowLink[calls.back().first] = std::min(lowLink[calls.back().first], lowLink[state]);
+            }
+            if (lowLink[state] == visitIndex[state])
+            {
+                finish(state);
             }
         }
     }
-    // std::cout << "\t" << initialState << "((" << initialState << " initial ))\n";
-    for (const auto &state : states)
+    FSA_METRIC_SET(epsilonComponents, components);
+
+    std::vector<uint32_t> idOf(components, UNVISITED);
+    std::vector<uint32_t> order{componentOf[initialState]};
+    idOf[order[0]] = 0;
+    std::vector<bool> newFinal;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> newTags;
+    std::vector<uint32_t> newStart{0};
+    std::vector<char> newSymbols;
+    std::vector<uint32_t> newTargets;
+    for (uint32_t id = 0; id < order.size(); id++)
     {
-        if (finalStates.count(state))
+        uint32_t component = order[id];
+        newFinal.push_back(foldedFinal[component]);
+        if (!acceptTags.empty() && foldedFinal[component] && !foldedTags[component].empty())
         {
-            std::cout << "\t" << state << "(((" << state << ")))\n";
+            newTags[id] = std::move(foldedTags[component]);
         }
-        else if (state == initialState)
+
+        moves.clear();
+        for (uint32_t j = foldStart[component]; j < foldStart[component + 1]; j++)
         {
-            std::cout << "\t" << state << "((" << state << " init))\n";
+            uint32_t target = componentOf[folded[j].second];
+            if (idOf[target] == UNVISITED)
+            {
+                idOf[target] = static_cast<uint32_t>(order.size());
+                order.push_back(target);
+            }
+            moves.emplace_back(folded[j].first, idOf[target]);
         }
-        else
+        std::sort(moves.begin(), moves.end());
+        moves.erase(std::unique(moves.begin(), moves.end()), moves.end());
+        for (const auto &[symbol, target] : moves)
         {
-            std::cout << "\t" << state << "((" << state << " ))\n";
+            newSymbols.push_back(symbol);
+            newTargets.push_back(target);
         }
+        newStart.push_back(static_cast<uint32_t>(newTargets.size()));
     }
 
-    std::cerr << "Number of states: " << states.size() << '\n';
-    std::cerr << "Number of transitions: " << numberOfTransitions << '\n';
-}
-
-void FSA::copyTransitionsWithOffset(size_t offset, const FSA &other)
-{
-    std::unordered_map<size_t, size_t> visited;
-    copyTransitionsWithOffset(offset, other, visited);
+    initialState = 0;
+    finalStates = std::move(newFinal);
+    acceptTags = std::move(newTags);
+    moveStart = std::move(newStart);
+    moveSymbols = std::move(newSymbols);
+    moveTargets = std::move(newTargets);
 }
 
-void FSA::copyTransitionsWithOffset(size_t offset, const FSA &other, std::unordered_map<size_t, size_t> &visited)
+// Scratch space for expanding one subset of a DenseNFA: the moves of its members are sorted by
+// symbol, and the successor on each symbol is the set of their targets.
+struct SubsetSuccessors
 {
-    // auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::pair<char, uint32_t>> moves;
+    std::vector<uint32_t> stamp;
+    std::vector<uint32_t> target;
+    uint32_t epoch;
 
-    std::queue<std::pair<size_t, size_t>> FSAQueue;
-
-    visited[other.initialState] = offset;
-    states.insert(offset);
-    FSAQueue.push(std::make_pair(other.initialState, offset));
+    explicit SubsetSuccessors(size_t nfaStates) : stamp(nfaStates, 0), epoch(0)
+    {
+    }
 
-    while (!FSAQueue.empty())
+    // Calls onMove(symbol, successor) in increasing symbol order and returns whether the subset
+    // is final. The members are only read before the first call, so onMove may invalidate them.
+    template <typename OnMove>
+    bool expand(const DenseNFA &nfa, const uint32_t *first, const uint32_t *last, OnMove &&onMove)
     {
-        auto &[currentOtherState, currentState] = FSAQueue.front();
-        FSAQueue.pop();
+        bool final = false;
+        moves.clear();
+        for (const uint32_t *member = first; member != last; ++member)
+        {
+            final = final || nfa.finalStates[*member];
+            for (uint32_t j = nfa.moveStart[*member]; j < nfa.moveStart[*member + 1]; j++)
+            {
+                moves.emplace_back(nfa.moveSymbols[j], nfa.moveTargets[j]);
+            }
+        }
+        std::sort(moves.begin(), moves.end());
 
-        if (other.transitions.find(currentOtherState) != other.transitions.end())
+        for (size_t i = 0; i < moves.size();)
         {
-            for (const auto &[symbol, toStates] : other.transitions.at(currentOtherState))
+            char symbol = moves[i].first;
+            epoch++;
+            target.clear();
+            for (; i < moves.size() && moves[i].first == symbol; i++)
             {
-                for (const auto &toState : toStates)
+                uint32_t next = moves[i].second;
+                if (stamp[next] != epoch)
                 {
-                    offset++;
-                    while (transitions.find(offset) != transitions.end() || finalStates.count(offset) || offset == initialState)
-                    {
-                        offset++;
-                    }
-
-                    if (visited.find(toState) != visited.end())
-                    {
-                        transitions[currentState][symbol].insert(visited[toState]);
-                        // FSAQueue.push(std::make_pair(toState, visited[toState]));
-                    }
-                    else
-                    {
-                        transitions[currentState][symbol].insert(offset);
-                        visited[toState] = offset;
-                        states.insert(offset);
-                        FSAQueue.push(std::make_pair(toState, offset));
-                    }
+                    stamp[next] = epoch;
+                    target.push_back(next);
                 }
             }
+            std::sort(target.begin(), target.end());
+            onMove(symbol, target);
         }
+        return final;
     }
+};
 
-    nextState = offset + 1;
-    // auto end = std::chrono::high_resolution_clock::now();
-    // std::cerr << "copying transitions took: " << end.time_since_epoch().count() - start.time_since_epoch().count() << " nanoseconds\n";
-}
-
-bool FSA::isOperator(char ch)
-{
-    return ch == '*' || ch == '&' || ch == '|' || ch == '^';
-}
-
-bool FSA::isSpecial(char ch)
+// Partition of the 256 byte values into classes of symbols that no transition distinguishes.
+// Transitions are labelled with the representative (smallest byte) of their class, and class 0
+// always holds EPSILON together with every byte that has no transition at all.
+struct ByteClasses
 {
-    return isOperator(ch) || ch == '(' || ch == ')';
-}
+    std::array<uint8_t, 256> classOf;
+    std::vector<unsigned char> representatives;
 
-int FSA::precedence(char op)
-{
-    switch (op)
+    ByteClasses() : representatives(256)
     {
-    case '*':
-    case '^':
-        return 3;
-    case '&':
-        return 2;
-    case '|':
-        return 1;
-    default:
-        return -1;
+        for (size_t byte = 0; byte < 256; byte++)
+        {
+            classOf[byte] = static_cast<uint8_t>(byte);
+            representatives[byte] = static_cast<unsigned char>(byte);
+        }
     }
-}
 
-void FSA::process_operator(std::stack<FSA *> &automatas, char op)
-{
-    FSA *a = automatas.top();
-    automatas.pop();
+    size_t size() const { return representatives.size(); }
 
-    if (op == '*')
+    unsigned char representative(unsigned char byte) const
     {
-        a->kleene();
-        a->determinize();
-        automatas.push(a);
+        return representatives[classOf[byte]];
     }
-    else if (op == '^')
+
+    // the bytes of the class of symbol in increasing order
+    std::string members(char symbol) const
     {
-        a->reverse();
-        automatas.push(a);
+        std::string result;
+        uint8_t cls = classOf[static_cast<unsigned char>(symbol)];
+        for (size_t byte = 0; byte < 256; byte++)
+        {
+            if (classOf[byte] == cls)
+            {
+                result += static_cast<char>(byte);
+            }
+        }
+        return result;
     }
-    else if ( op == '~' )
+
+    // moves the bytes of class 0 other than EPSILON, which no transition is labelled with, to a
+    // class of their own
+    void separateUnused()
     {
-        a->complement();
-        automatas.push(a);
+        std::string unused = members(0);
+        if (unused.size() < 2)
+        {
+            return;
+        }
+        uint8_t cls = static_cast<uint8_t>(representatives.size());
+        representatives.push_back(static_cast<unsigned char>(unused[1]));
+        for (size_t i = 1; i < unused.size(); i++)
+        {
+            classOf[static_cast<unsigned char>(unused[i])] = cls;
+        }
     }
-    else
+
+    // the coarsest classes that refine both a and b, each represented by its smallest byte
+    static ByteClasses meet(const ByteClasses &a, const ByteClasses &b)
     {
-        FSA *b = automatas.top();
-        automatas.pop();
-        switch (op)
+        ByteClasses classes;
+        classes.representatives.clear();
+        std::map<std::pair<uint8_t, uint8_t>, uint8_t> classOfPair;
+        for (size_t byte = 0; byte < 256; byte++)
         {
-        case '&':
-            b->concatenateWith(*a);
-            automatas.push(b);
-            delete a;
-
-            break;
-        case '|':
-            b->unionWith(*a);
-            b->determinize();
-            automatas.push(b);
-            delete a;
-
-            break;
-        case '-':
-            b->difference(*a);
-            b->determinize();
-            automatas.push(b);
-            break;
+            auto [match, inserted] = classOfPair.try_emplace(std::make_pair(a.classOf[byte], b.classOf[byte]),
+                                                             static_cast<uint8_t>(classes.representatives.size()));
+            if (inserted)
+            {
+                classes.representatives.push_back(static_cast<unsigned char>(byte));
+            }
+            classes.classOf[byte] = match->second;
         }
+        return classes;
     }
-}
+};
 
-FSA *FSA::parseExpression(const std::string &expression)
+// Refinable partition of the elements 0..n-1 (Valmari & Lehtinen). Elements of a set are kept
+// contiguous in `elements`, so marking and splitting a set is proportional to the marked elements.
+// The marked/touched scratch arrays are shared by every partition that takes part in one refinement.
+struct RefinablePartition
 {
-    auto timeStart = std::chrono::high_resolution_clock::now();
-
-    std::stack<FSA *> automatas;
-    std::stack<char> operators;
-
-    bool expect_operator = false;
-
-    for (char ch : expression)
+    uint32_t sets;
+    std::vector<uint32_t> elements, location, setOf, first, past;
+    std::vector<uint32_t> &marked;
+    std::vector<uint32_t> &touched;
+    uint32_t touchedCount;
+
+    RefinablePartition(uint32_t n, std::vector<uint32_t> &marked, std::vector<uint32_t> &touched)
+        : sets(n > 0), elements(n), location(n), setOf(n, 0), first(n + 1, 0), past(n + 1, 0),
+          marked(marked), touched(touched), touchedCount(0)
     {
-        if (isspace(ch))
+        for (uint32_t i = 0; i < n; i++)
         {
-            continue;
+            elements[i] = location[i] = i;
         }
+        past[0] = n;
+    }
 
-        if (ch == '(')
+    void mark(uint32_t e)
+    {
+        uint32_t s = setOf[e];
+        uint32_t i = location[e];
+        uint32_t j = first[s] + marked[s];
+        elements[i] = elements[j];
+        location[elements[i]] = i;
+        elements[j] = e;
+        location[e] = j;
+        if (!marked[s]++)
         {
-            if (expect_operator)
-            {
-                while (!operators.empty() && precedence('&') <= precedence(operators.top()))
-                {
-                    process_operator(automatas, operators.top());
-                    operators.pop();
-                }
-                operators.push('&');
-            }
-            operators.push(ch);
-            expect_operator = false;
+            touched[touchedCount++] = s;
         }
-        else if (ch == ')')
+    }
+
+    // moves the smaller of the marked and unmarked parts of every touched set into a new set
+    void split()
+    {
+        while (touchedCount)
         {
-            while (operators.top() != '(')
+            uint32_t s = touched[--touchedCount];
+            uint32_t j = first[s] + marked[s];
+            if (j == past[s])
             {
-                process_operator(automatas, operators.top());
-                operators.pop();
+                marked[s] = 0;
+                continue;
             }
-            operators.pop();
-            expect_operator = true;
-        }
-        else if (ch == '*' || ch == '^' || ch == '~')
-        {
-            if (!expect_operator)
+            if (marked[s] <= past[s] - j)
             {
-                throw std::runtime_error("Unexpected character: " + std::string(1, ch));
+                first[sets] = first[s];
+                past[sets] = first[s] = j;
             }
-            process_operator(automatas, ch);
-        }
-        else if (isOperator(ch))
-        {
-            while (!operators.empty() && precedence(ch) <= precedence(operators.top()))
+            else
             {
-                process_operator(automatas, operators.top());
-                operators.pop();
+                past[sets] = past[s];
+                first[sets] = past[s] = j;
             }
-            operators.push(ch);
-            expect_operator = false;
-        }
-        else
-        {
-            if (expect_operator)
+            for (uint32_t i = first[sets]; i < past[sets]; i++)
             {
-                while (!operators.empty() && precedence('&') <= precedence(operators.top()))
-                {
-                    process_operator(automatas, operators.top());
-                    operators.pop();
-                }
-                operators.push('&');
+                setOf[elements[i]] = sets;
             }
-            automatas.push(new FSA(ch));
-            expect_operator = true;
+            marked[s] = marked[sets++] = 0;
+            FSA_METRIC_ADD(refinementSplits, 1);
         }
     }
+};
 
-    while (!operators.empty())
+// Runs body(i) for every i below count, split into one contiguous chunk per thread.
+template <typename Body>
+void parallelFor(size_t threads, size_t count, Body &&body)
+{
+    size_t chunk = threads > 1 ? (count + threads - 1) / threads : count;
+    std::vector<std::thread> pool;
+    for (size_t begin = chunk; begin < count; begin += chunk)
     {
-        process_operator(automatas, operators.top());
-        operators.pop();
+        pool.emplace_back([&body, begin, end = std::min(count, begin + chunk)]
+                          {
+                              for (size_t i = begin; i < end; i++)
+                              {
+                                  body(i);
+                              } });
     }
-
-    while (automatas.size() != 1)
+    for (size_t i = 0; i < std::min(count, chunk); i++)
     {
-        process_operator(automatas, '&');
+        body(i);
+    }
+    for (auto &thread : pool)
+    {
+        thread.join();
     }
-
-    auto timeEnd = std::chrono::high_resolution_clock::now();
-    std::cerr << "nda build took: " << timeEnd.time_since_epoch().count() - timeStart.time_since_epoch().count() << " nanoseconds\n";
-
-    automatas.top()->print();
-
-    automatas.top()->determinize();
-    automatas.top()->minimize();
-    return automatas.top();
 }
 
-/*
-bool FSA::accepts(const std::string &word)
+// Threads started once and reused for every loop run on them, so an algorithm with many short
+// parallel rounds does not pay for creating threads in each. The calling thread takes part too.
+class WorkerGroup
 {
-    std::queue<std::pair<size_t, size_t>> nextStates;
+private:
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable started, finished;
+    // the chunk body of the current loop; a worker runs it when round passes the last it saw
+    const std::function<void(size_t, size_t)> *range;
+    size_t count, chunk, round, running;
+    bool stopping;
+
+    void work(size_t index);
+
+public:
+    explicit WorkerGroup(size_t threads);
+    ~WorkerGroup();
 
-    size_t wordCursor = 0;
-    size_t wordSize = word.size();
+    size_t size() const { return workers.size() + 1; }
+    // runs body(i) for every i below count like parallelFor
+    template <typename Body>
+    void run(size_t count, Body &&body);
+};
 
-    if (transitions[initialState].count('\0'))
+WorkerGroup::WorkerGroup(size_t threads) : range(nullptr), count(0), chunk(0), round(0), running(0), stopping(false)
+{
+    for (size_t index = 1; index < threads; index++)
     {
-        for (const &toState : transitions[initialState]['\0'])
-        {
-            nextStates.push(std::make_pair(toState, initialState));
-        }
+        workers.emplace_back([this, index]
+                             { work(index); });
     }
+}
 
-    while (wordCursor < wordSize && !nextStates.empty())
+WorkerGroup::~WorkerGroup()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    started.notify_all();
+    for (auto &worker : workers)
     {
-        auto &[currentState, previousState] = nextStates.front();
-        nextStates.pop();
+        worker.join();
+    }
+}
 
-        if (transitions[currentState].count('\0'))
+void WorkerGroup::work(size_t index)
+{
+    size_t seen = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        started.wait(guard, [&]
+                     { return stopping || round != seen; });
+        if (stopping)
         {
-            for (const &toState : transitions[currentState]['\0'])
-            {
-                if (toState != previousState)
-                {
-                    nextStates.push(std::make_pair(toState, currentState));
-                }
-            }
+            return;
         }
-        if (transitions[currentState].count(word[wordCursor]))
+        seen = round;
+        size_t begin = std::min(count, index * chunk), end = std::min(count, begin + chunk);
+        guard.unlock();
+        if (begin < end)
         {
-            for (const &toState : transitions[currentState][word[wordCursor]])
-            {
-                nextStates.push(std::make_pair(toState, currentState));
-            }
+            (*range)(begin, end);
+        }
+        guard.lock();
+        if (--running == 0)
+        {
+            finished.notify_one();
         }
     }
+}
 
-    bool containsFinal = false;
-    while (!nextStates.empty())
+template <typename Body>
+void WorkerGroup::run(size_t count, Body &&body)
+{
+    std::function<void(size_t, size_t)> loop = [&body](size_t begin, size_t end)
     {
-        auto &[currentState, previousState] = nextStates.front();
-        nextStates.pop();
-
-        if ( previousState == finalState )
+        for (size_t i = begin; i < end; i++)
         {
-            containsFinal = true;
-            break;
+            body(i);
         }
+    };
+    size_t share = (count + size() - 1) / size();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        range = &loop;
+        this->count = count;
+        chunk = share;
+        running = workers.size();
+        round++;
     }
-
-    return wordCursor >= wordSize && containsFinal;
+    started.notify_all();
+    loop(0, std::min(count, share));
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [&]
+                  { return running == 0; });
 }
-*/
-void FSA::unionWith(const FSA &other)
+
+// The containers of an automaton allocate from a memory resource. Every fragment built while
+// compiling one expression shares a pool that the resulting automaton keeps alive, so the
+// combinators can splice nodes between fragments and the whole compile is released at once.
+class FSA
 {
-    // auto start = std::chrono::high_resolution_clock::now();
+public:
+    using Arena = std::shared_ptr<std::pmr::memory_resource>;
 
-    size_t newInitialState = nextState++;
-    states.insert(newInitialState);
+    enum class Engine
+    {
+        Thompson,
+        Glushkov,
+        Brzozowski
+    };
+
+    // Eager determinizes and minimizes the result of every '*' and '|' to keep the fragments
+    // small. Lazy leaves them as NFA operations for LazyDFA, which only determinizes the subsets
+    // the input reaches. Either way '~', '%' and '-' determinize their operands, and the derivative
+    // engine always builds a whole DFA.
+    enum class Construction
+    {
+        Eager,
+        Lazy
+    };
 
-    transitions[newInitialState][EPSILON].insert(initialState);
-    transitions[newInitialState][EPSILON].insert(nextState);
-    initialState = newInitialState;
+private:
+    using StateSet = std::pmr::unordered_set<size_t>;
+    using TransitionMap = std::pmr::unordered_map<size_t, std::pmr::unordered_map<char, StateSet>>;
+    using TagMap = std::pmr::unordered_map<size_t, std::pmr::vector<uint32_t>>;
+
+    // declared first so that it outlives the containers allocating from it
+    Arena arena;
 
-    copyTransitionsWithOffset(nextState, other);
+    size_t initialState;
+    StateSet states;
+    StateSet finalStates;
+    // the sorted IDs of the patterns each final state accepts, for automata built by parsePatterns;
+    // only unionWith, determinize and minimize keep them, the other operators drop them
+    TagMap acceptTags;
+    TransitionMap transitions;
+    // the number of (state, symbol, target) triples in transitions, kept up to date by every
+    // function that changes them so that transitionCount does not walk the map
+    size_t numberOfTransitions;
+    ByteClasses alphabet;
+    // Missing transitions lead to an implicit sink state that loops on every byte. It rejects
+    // unless sinkFinal is set, so the complement of a partial DFA is the same DFA with its final
+    // states flipped. Only deterministic automata have an accepting sink.
+    bool sinkFinal;
+    // set by tag and kept along with acceptTags, so an automaton whose patterns all have empty
+    // languages still reports an empty set of matches rather than none at all
+    bool multiPattern;
+
+    static void process_operator(FSA &a, FSA *b, char op, Construction construction);
+    static FSA thompson(const RegexAST &ast, const Arena &arena, Construction construction);
+    static FSA glushkov(const RegexAST &ast, uint32_t node, const Arena &arena, Construction construction);
+    static FSA positionAutomaton(const RegexAST &ast, uint32_t node, const Arena &arena);
+    static FSA brzozowski(const RegexAST &ast, const Arena &arena);
+    static FSA construct(const RegexAST &ast, Engine engine, const Arena &arena,
+                         Construction construction = Construction::Eager);
+
+    // states are numbered 0 .. nextState - 1
+    size_t nextState;
+    std::pmr::memory_resource *resource() const { return transitions.get_allocator().resource(); }
+    size_t splice(FSA &&other);
+    void addTransition(size_t fromState, char symbol, size_t toState);
+
+    void tag(uint32_t pattern);
+    void unionWith(FSA &&other);
+    void concatenateWith(FSA &&other);
+    void kleene();
+    void reverse();
 
-    if (finalStates.size() != 1)
+    enum class Combination
     {
-        // std::cerr << "undefined behav union" << '\n';
-    }
+        Intersection,
+        Difference,
+        Union
+    };
 
-    for (const auto &finalState : finalStates)
+    void complement();
+    void intersect(FSA &&other);
+    void difference(FSA &&other);
+    void product(FSA &other, Combination combination);
+    void materializeSink();
+    void refineAlphabet(const ByteClasses &finer);
+    void shareAlphabet(FSA &other);
+
+    bool isDeterministic() const;
+    std::unordered_set<size_t> liveStates() const;
+
+    ByteClasses symbolClasses() const;
+
+    DenseNFA toDenseNFA() const;
+    static size_t subsetConstruction(const DenseNFA &nfa, TransitionMap &newTransitions, StateSet &newFinalStates,
+                                     TagMap &newTags);
+    static size_t parallelSubsetConstruction(const DenseNFA &nfa, size_t threads, TransitionMap &newTransitions,
+                                             StateSet &newFinalStates, TagMap &newTags);
+    void mergeStates(std::unordered_map<size_t, size_t> &partition);
+    static std::vector<uint32_t> valmariLehtinen(const std::vector<uint32_t> &accept, const std::vector<uint32_t> &tails,
+                                                 const std::vector<unsigned char> &labels, const std::vector<uint32_t> &heads);
+    static bool mooreRefinement(std::vector<uint32_t> &block, const std::vector<uint32_t> &tails,
+                                const std::vector<unsigned char> &labels, const std::vector<uint32_t> &heads, size_t threads,
+                                bool bounded);
+
+    friend class DenseDFA;
+    friend class LazyDFA;
+    friend class CompileCache;
+
+public:
+    enum class Minimization
     {
-        transitions[finalState][EPSILON].insert(nextState);
-        states.insert(finalState);
-    }
-    transitions[nextState - 1][EPSILON].insert(nextState);
-    states.insert(nextState - 1);
+        Automatic,
+        Sequential,
+        Parallel
+    };
+
+    // Automatic tries the parallel refinement for DFAs with at least this many transitions, until a
+    // round adds fewer than a PARALLEL_MINIMIZE_GROWTH-th of the blocks there were
+    static constexpr size_t PARALLEL_MINIMIZE_TRANSITIONS = 1 << 20;
+    static constexpr size_t PARALLEL_MINIMIZE_GROWTH = 4;
+
+    explicit FSA(Arena arena = nullptr);
+    FSA(char symbol, Arena arena = nullptr);
+    FSA(const FSA &other);
+    FSA(const FSA &other, Arena arena);
+    FSA(FSA &&other) noexcept;
+    ~FSA();
 
-    states.insert(nextState);
-    finalStates = {nextState++};
-    // finalState = nextState++;
+    static Arena makeArena();
 
-    // auto end = std::chrono::high_resolution_clock::now();
-    // std::cerr << "union took: " << end.time_since_epoch().count() - start.time_since_epoch().count() << " nanoseconds\n";
-}
+    // Passes every transition, state and the accepting sink to writer and ends it; writers for
+    // Mermaid, DOT and an edge list are in Export.cpp. print writes Mermaid to stdout and the
+    // counts to stderr.
+    template <typename Writer>
+    void write(Writer &writer) const;
+    void print() const;
 
-void FSA::concatenateWith(const FSA &other)
-{
-    // auto start = std::chrono::high_resolution_clock::now();
+    size_t stateCount() const;
+    size_t transitionCount() const;
+
+    // threads > 1 expands subsets on that many threads, 0 uses every hardware thread
+    void determinize(size_t threads = 1);
+    void minimize(size_t threads = 1, Minimization mode = Minimization::Automatic);
+    void compressAlphabet();
+    // relabels every transition with each byte of its class and resets the alphabet
+    void expandAlphabet();
+
+    static FSA *fromAST(const RegexAST &ast, Engine engine = Engine::Thompson,
+                        Construction construction = Construction::Eager);
+    static FSA *parseNFA(const std::string &expression, Engine engine = Engine::Thompson);
+    static FSA *parseExpression(const std::string &expression, Engine engine = Engine::Thompson, size_t threads = 1);
+    // one DFA for all the expressions, whose final states carry the indices of the ones they accept
+    static FSA *parsePatterns(const std::vector<std::string> &expressions, Engine engine = Engine::Thompson,
+                              size_t threads = 1);
+};
 
-    std::unordered_map<size_t, size_t> visited;
-    if (finalStates.size() != 1)
+// Bounded process-wide memo of compiled subexpressions. Subtrees are hash-consed across
+// expressions into global node IDs, so identical subexpressions of different calls get the same ID
+// and a lookup is one probe. Entries are evicted least recently used first once the automata
+// hold more than the capacity in states; the node table is reset when it outgrows its limit.
+// IDs are never reused: a reset starts a new generation at the next unused ID, and find and insert
+// ignore the IDs of earlier generations that other threads may still hold.
+class CompileCache
+{
+private:
+    struct Node
     {
-        // std::cerr << "undefined behav concat1" << '\n';
-    }
+        char op;
+        char symbol;
+        uint64_t left;
+        uint64_t right;
+
+        bool operator==(const Node &other) const
+        {
+            return op == other.op && symbol == other.symbol && left == other.left && right == other.right;
+        }
+    };
+
+    struct NodeHash
+    {
+        std::size_t operator()(const Node &node) const
+        {
+            return RegexNodeHash()({node.op, node.symbol, static_cast<uint32_t>(node.left),
+                                    static_cast<uint32_t>(node.right)}) ^
+                   ((node.left >> 32) * 0x9E3779B97F4A7C15ull) ^ ((node.right >> 32) * 0xFF51AFD7ED558CCDull);
+        }
+    };
+
+    using Entries = std::list<std::pair<uint64_t, FSA>>;
+
+    mutable std::mutex lock;
+    std::unordered_map<Node, uint64_t, NodeHash> ids;
+    Entries entries;
+    std::unordered_map<uint64_t, Entries::iterator> index;
+    size_t states = 0;
+    size_t capacity = DEFAULT_CAPACITY;
+    uint64_t nextID = 0;
+    uint64_t generation = 0;
+
+    void evict();
+    void reset();
+
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
+    static constexpr size_t NODE_LIMIT = 1 << 20;
+    static constexpr uint64_t NONE = UINT64_MAX;
+
+    static CompileCache &global();
+
+    // the global ID of every node of ast, or none when the cache is disabled
+    std::vector<uint64_t> identify(const RegexAST &ast);
+    // a copy of the automaton of a node allocating from arena, if it is cached
+    std::optional<FSA> find(uint64_t id, const FSA::Arena &arena);
+    void insert(uint64_t id, const FSA &automaton);
+
+    // the capacity is in states, 0 disables the cache
+    void setCapacity(size_t states);
+    void clear();
+    size_t size() const;
+};
+
+CompileCache &CompileCache::global()
+{
+    static CompileCache cache;
+    return cache;
+}
+
+std::vector<uint64_t> CompileCache::identify(const RegexAST &ast)
+{
+    // only the operators that determinize or build a product are worth caching
+    bool worthCaching = std::any_of(ast.nodes.begin(), ast.nodes.end(), [](const RegexNode &node)
+                                    { return node.op == '*' || node.op == '|' || node.op == '%' || node.op == '-'; });
+    std::lock_guard<std::mutex> guard(lock);
+    if (capacity == 0 || !worthCaching)
+    {
+        return {};
+    }
+    if (ids.size() + ast.nodes.size() > NODE_LIMIT)
+    {
+        reset();
+    }
+
+    std::vector<uint64_t> id(ast.nodes.size());
+    for (size_t i = 0; i < ast.nodes.size(); i++)
+    {
+        const RegexNode &node = ast.nodes[i];
+        Node key{node.op, node.symbol, node.left == RegexAST::NONE ? NONE : id[node.left],
+                 node.right == RegexAST::NONE ? NONE : id[node.right]};
+        auto [match, inserted] = ids.emplace(key, nextID);
+        nextID += inserted;
+        id[i] = match->second;
+    }
+    return id;
+}
+
+std::optional<FSA> CompileCache::find(uint64_t id, const FSA::Arena &arena)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    FSA_METRIC_ADD(cacheLookups, 1);
+    if (id < generation)
+    {
+        return std::nullopt;
+    }
+    auto it = index.find(id);
+    if (it == index.end())
+    {
+        return std::nullopt;
+    }
+    FSA_METRIC_ADD(cacheHits, 1);
+    entries.splice(entries.begin(), entries, it->second);
+    return FSA(it->second->second, arena);
+}
+
+void CompileCache::insert(uint64_t id, const FSA &automaton)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (id < generation || automaton.stateCount() > capacity || index.count(id))
+    {
+        return;
+    }
+    entries.emplace_front(std::piecewise_construct, std::forward_as_tuple(id), std::forward_as_tuple(automaton, nullptr));
+    index[id] = entries.begin();
+    states += automaton.stateCount();
+    evict();
+}
+
+void CompileCache::evict()
+{
+    while (states > capacity)
+    {
+        states -= entries.back().second.stateCount();
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+void CompileCache::setCapacity(size_t states)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    capacity = states;
+    evict();
+}
+
+// drops the node table and the entries together and starts a new generation of IDs
+void CompileCache::reset()
+{
+    ids.clear();
+    entries.clear();
+    index.clear();
+    states = 0;
+    generation = nextID;
+}
+
+void CompileCache::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    reset();
+}
+
+size_t CompileCache::size() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size();
+}
+
+FSA::FSA(Arena arena)
+    : arena(std::move(arena)), initialState(0),
+      states(this->arena ? this->arena.get() : std::pmr::get_default_resource()),
+      finalStates(states.get_allocator()), acceptTags(states.get_allocator()), transitions(states.get_allocator()),
+      numberOfTransitions(0), sinkFinal(false), multiPattern(false), nextState(2)
+{
+    states.insert({0, 1});
+    finalStates.insert(1);
+}
+
+FSA::FSA(char symbol, Arena arena) : FSA(std::move(arena))
+{
+    addTransition(0, symbol, 1);
+}
+
+// a copy is independent of the arena of the original and allocates from the default resource
+FSA::FSA(const FSA &other) : initialState(other.initialState), states(other.states), finalStates(other.finalStates),
+                             acceptTags(other.acceptTags), transitions(other.transitions),
+                             numberOfTransitions(other.numberOfTransitions), alphabet(other.alphabet),
+                             sinkFinal(other.sinkFinal), multiPattern(other.multiPattern), nextState(other.nextState)
+{
+}
+
+// a copy that allocates from arena, or from the default resource without one
+FSA::FSA(const FSA &other, Arena arena)
+    : arena(std::move(arena)), initialState(other.initialState),
+      states(other.states, this->arena ? this->arena.get() : std::pmr::get_default_resource()),
+      finalStates(other.finalStates, states.get_allocator()), acceptTags(other.acceptTags, states.get_allocator()),
+      transitions(other.transitions, states.get_allocator()), numberOfTransitions(other.numberOfTransitions),
+      alphabet(other.alphabet),
+      sinkFinal(other.sinkFinal), multiPattern(other.multiPattern), nextState(other.nextState)
+{
+}
+
+FSA::FSA(FSA &&other) noexcept
+    : arena(std::move(other.arena)), initialState(other.initialState), states(std::move(other.states)),
+      finalStates(std::move(other.finalStates)), acceptTags(std::move(other.acceptTags)),
+      transitions(std::move(other.transitions)), numberOfTransitions(other.numberOfTransitions),
+      alphabet(std::move(other.alphabet)), sinkFinal(other.sinkFinal), multiPattern(other.multiPattern),
+      nextState(other.nextState)
+{
+}
+
+FSA::Arena FSA::makeArena()
+{
+    return std::make_shared<std::pmr::unsynchronized_pool_resource>();
+}
+
+FSA::~FSA()
+{
+    states.clear();
+    finalStates.clear();
+    acceptTags.clear();
+    transitions.clear();
+}
+
+template <typename Writer>
+void FSA::write(Writer &writer) const
+{
+    // the labels of the few symbol classes are formatted once
+    std::unordered_map<char, std::string> labels;
+    const std::string epsilon;
+    for (const auto &[fromState, symbolToStates] : transitions)
+    {
+        for (const auto &[symbol, toStates] : symbolToStates)
+        {
+            auto label = labels.find(symbol);
+            if (label == labels.end() && symbol != EPSILON)
+            {
+                label = labels.emplace(symbol, alphabet.members(symbol)).first;
+            }
+            for (const auto &toState : toStates)
+            {
+                writer.transition(fromState, toState, symbol == EPSILON ? epsilon : label->second);
+            }
+        }
+    }
+    for (const auto &state : states)
+    {
+        writer.state(state, state == initialState, finalStates.count(state) != 0);
+    }
+    if (sinkFinal)
+    {
+        // every missing transition leads here
+        writer.sink();
+    }
+    writer.end();
+}
+
+void FSA::print() const
+{
+    MermaidWriter writer(std::cout);
+    write(writer);
+    std::cerr << "Number of states: " << writer.states() << '\n';
+    std::cerr << "Number of transitions: " << writer.transitions() << '\n';
+}
+
+size_t FSA::stateCount() const
+{
+    return states.size();
+}
+
+size_t FSA::transitionCount() const
+{
+    return numberOfTransitions;
+}
+
+void FSA::addTransition(size_t fromState, char symbol, size_t toState)
+{
+    numberOfTransitions += transitions[fromState][symbol].insert(toState).second;
+}
+
+// Moves the states and transitions of other into this automaton, numbered after the states of
+// this one, and returns the offset added to them. The hash nodes of other are relinked rather
+// than copied, so nothing is allocated when both automata share an arena.
+size_t FSA::splice(FSA &&other)
+{
+    shareAlphabet(other);
+    size_t base = nextState;
+    nextState += other.nextState;
+
+    // nodes can only be relinked between containers that allocate from the same resource
+    StateSet *sourceStates = &other.states;
+    TransitionMap *source = &other.transitions;
+    StateSet copiedStates(resource());
+    TransitionMap copied(resource());
+    if (other.transitions.get_allocator() != transitions.get_allocator())
+    {
+        copiedStates = other.states;
+        copied = other.transitions;
+        sourceStates = &copiedStates;
+        source = &copied;
+    }
+
+    while (!sourceStates->empty())
+    {
+        auto node = sourceStates->extract(sourceStates->begin());
+        node.value() += base;
+        states.insert(std::move(node));
+    }
+
+    std::vector<StateSet::node_type> targets;
+    while (!source->empty())
+    {
+        auto node = source->extract(source->begin());
+        for (auto &[symbol, toStates] : node.mapped())
+        {
+            while (!toStates.empty())
+            {
+                targets.push_back(toStates.extract(toStates.begin()));
+            }
+            for (auto &target : targets)
+            {
+                target.value() += base;
+                toStates.insert(std::move(target));
+            }
+            targets.clear();
+        }
+        node.key() += base;
+        transitions.insert(std::move(node));
+    }
+    numberOfTransitions += other.numberOfTransitions;
+    other.numberOfTransitions = 0;
+
+    for (auto &[state, tags] : other.acceptTags)
+    {
+        acceptTags.emplace(base + state, std::move(tags));
+    }
+    other.acceptTags.clear();
+    return base;
+}
+
+// Applies op to a. A binary operator takes a as its left operand and consumes b, the right one.
+void FSA::process_operator(FSA &a, FSA *b, char op, Construction construction)
+{
+    bool eager = construction == Construction::Eager;
+    switch (op)
+    {
+    case '*':
+        a.kleene();
+        if (eager)
+        {
+            a.determinize();
+            a.minimize();
+        }
+        break;
+    case '^':
+        a.reverse();
+        break;
+    case '~':
+        a.complement();
+        break;
+    case '&':
+        a.concatenateWith(std::move(*b));
+        break;
+    case '|':
+        a.unionWith(std::move(*b));
+        if (eager)
+        {
+            a.determinize();
+            a.minimize();
+        }
+        break;
+    case '%':
+        a.intersect(std::move(*b));
+        break;
+    case '-':
+        a.difference(std::move(*b));
+        break;
+    }
+}
+
+FSA *FSA::parseNFA(const std::string &expression, Engine engine)
+{
+    return fromAST(RegexAST::parse(expression), engine);
+}
+
+// The result is copied onto the default resource, so the arena and every fragment allocated from
+// it are released when the compile returns rather than when the result is deleted.
+FSA *FSA::fromAST(const RegexAST &ast, Engine engine, Construction construction)
+{
+    Arena arena = makeArena();
+    return new FSA(construct(ast, engine, arena, construction), nullptr);
+}
+
+FSA FSA::construct(const RegexAST &ast, Engine engine, const Arena &arena, Construction construction)
+{
+    FSA_METRIC_PHASE(NFA);
+    switch (engine)
+    {
+    case Engine::Glushkov:
+        return glushkov(ast, ast.root, arena, construction);
+    case Engine::Brzozowski:
+        return brzozowski(ast, arena);
+    default:
+        return thompson(ast, arena, construction);
+    }
+}
+
+FSA *FSA::parseExpression(const std::string &expression, Engine engine, size_t threads)
+{
+    RegexAST ast = RegexAST::parse(expression);
+    Arena arena = makeArena();
+    FSA automaton = construct(ast, engine, arena);
+    automaton.compressAlphabet();
+    automaton.determinize(threads);
+    automaton.minimize(threads);
+    automaton.compressAlphabet();
+    // only the minimal DFA outlives the compile, the arena goes with everything else it holds
+    return new FSA(automaton, nullptr);
+}
+
+// Every expression is compiled to a minimal DFA on its own, tagged with its index and added to
+// the union, which is then determinized and minimized as a whole. The fragments share one arena.
+FSA *FSA::parsePatterns(const std::vector<std::string> &expressions, Engine engine, size_t threads)
+{
+    if (expressions.empty())
+    {
+        throw std::runtime_error("No patterns");
+    }
+
+    Arena arena = makeArena();
+    std::unique_ptr<FSA> combined;
+    for (uint32_t pattern = 0; pattern < expressions.size(); pattern++)
+    {
+        RegexAST ast = RegexAST::parse(expressions[pattern]);
+        FSA automaton = construct(ast, engine, arena);
+        automaton.determinize();
+        automaton.minimize();
+        // the tags are attached to states, so the union needs the accepting sink as one
+        automaton.materializeSink();
+        automaton.tag(pattern);
+        if (combined == nullptr)
+        {
+            combined = std::make_unique<FSA>(std::move(automaton));
+        }
+        else
+        {
+            combined->unionWith(std::move(automaton));
+        }
+    }
+
+    combined->compressAlphabet();
+    combined->determinize(threads);
+    combined->minimize(threads);
+    combined->compressAlphabet();
+    // copied out of the arena of the fragments, which is released with the intermediate automaton
+    return new FSA(*combined, nullptr);
+}
+
+// The nodes of a parsed expression are in post-order, so running them front to back performs
+// exactly the operators of the expression. A hash-consed node is built once and its automaton is
+// kept until its last use, copied for every use before that. The operators that determinize or
+// build a product are looked up in and added to the process-wide cache; the subtrees below a
+// cached node are not built at all. A lazy construction leaves '*' and '|' out of the cache, whose
+// entries are the minimal DFAs of the eager one.
+FSA FSA::thompson(const RegexAST &ast, const Arena &arena, Construction construction)
+{
+    size_t n = ast.nodes.size();
+    CompileCache &cache = CompileCache::global();
+    std::vector<uint64_t> id = cache.identify(ast);
+    bool eager = construction == Construction::Eager;
+    auto cacheable = [&](const RegexNode &node)
+    {
+        return !id.empty() && (((node.op == '*' || node.op == '|') && eager) || node.op == '%' || node.op == '-');
+    };
+
+    // top-down, parents come after their operands: find the nodes to build and count their uses
+    std::vector<std::unique_ptr<FSA>> results(n);
+    std::vector<bool> needed(n, false);
+    std::vector<uint32_t> uses(n, 0);
+    needed[ast.root] = true;
+    uses[ast.root] = 1;
+    for (size_t i = n; i-- > 0;)
+    {
+        const RegexNode &node = ast.nodes[i];
+        if (!needed[i] || node.op == 0)
+        {
+            continue;
+        }
+        if (cacheable(node))
+        {
+            if (auto hit = cache.find(id[i], arena))
+            {
+                results[i] = std::make_unique<FSA>(std::move(*hit));
+                continue;
+            }
+        }
+        for (uint32_t operand : {node.left, node.right})
+        {
+            if (operand != RegexAST::NONE)
+            {
+                needed[operand] = true;
+                uses[operand]++;
+            }
+        }
+    }
+
+    // symbols are built afresh for every use, which is cheaper than copying them
+    auto take = [&](uint32_t operand)
+    {
+        if (ast.nodes[operand].op == 0)
+        {
+            return std::make_unique<FSA>(ast.nodes[operand].symbol, arena);
+        }
+        if (--uses[operand] == 0)
+        {
+            return std::move(results[operand]);
+        }
+        return std::make_unique<FSA>(*results[operand], arena);
+    };
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const RegexNode &node = ast.nodes[i];
+        if (!needed[i] || results[i] || node.op == 0)
+        {
+            continue;
+        }
+        std::unique_ptr<FSA> automaton = take(node.left);
+        if (node.right == RegexAST::NONE)
+        {
+            process_operator(*automaton, nullptr, node.op, construction);
+        }
+        else if (ast.nodes[node.right].op == 0)
+        {
+            FSA right(ast.nodes[node.right].symbol, arena);
+            process_operator(*automaton, &right, node.op, construction);
+        }
+        else
+        {
+            process_operator(*automaton, take(node.right).get(), node.op, construction);
+        }
+        if (cacheable(node))
+        {
+            cache.insert(id[i], *automaton);
+        }
+        results[i] = std::move(automaton);
+    }
+    return std::move(*take(ast.root));
+}
+
+// Subtrees built only from symbols, '|', '&' and '*' become position automata; the other
+// operators are applied to the automata of their operands.
+FSA FSA::glushkov(const RegexAST &ast, uint32_t node, const Arena &arena, Construction construction)
+{
+    std::vector<uint32_t> stack = {node};
+    bool regular = true;
+    while (!stack.empty() && regular)
+    {
+        const RegexNode &current = ast.nodes[stack.back()];
+        stack.pop_back();
+        if (current.op == 0)
+        {
+            continue;
+        }
+        regular = current.op == '|' || current.op == '&' || current.op == '*';
+        stack.push_back(current.left);
+        if (current.right != RegexAST::NONE)
+        {
+            stack.push_back(current.right);
+        }
+    }
+
+    if (regular)
+    {
+        return positionAutomaton(ast, node, arena);
+    }
+
+    const RegexNode &current = ast.nodes[node];
+    FSA automaton = glushkov(ast, current.left, arena, construction);
+    if (current.right != RegexAST::NONE)
+    {
+        FSA right = glushkov(ast, current.right, arena, construction);
+        process_operator(automaton, &right, current.op, construction);
+    }
+    else
+    {
+        process_operator(automaton, nullptr, current.op, construction);
+    }
+    return automaton;
+}
+
+// Glushkov construction: one state per symbol occurrence plus the initial state 0, with the
+// transitions given by the first, last and follow sets, so no epsilon transitions are needed.
+FSA FSA::positionAutomaton(const RegexAST &ast, uint32_t node, const Arena &arena)
+{
+    struct Positions
+    {
+        bool nullable;
+        std::vector<uint32_t> first;
+        std::vector<uint32_t> last;
+    };
+
+    auto merge = [](const std::vector<uint32_t> &a, const std::vector<uint32_t> &b)
+    {
+        std::vector<uint32_t> result;
+        result.reserve(a.size() + b.size());
+        std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+        return result;
+    };
+
+    std::vector<char> symbols = {EPSILON};
+    std::vector<std::vector<uint32_t>> follow = {{}};
+    std::vector<Positions> results;
+    std::vector<std::pair<uint32_t, bool>> stack = {{node, false}};
+
+    while (!stack.empty())
+    {
+        auto [index, expanded] = stack.back();
+        stack.pop_back();
+        const RegexNode &current = ast.nodes[index];
+
+        if (current.op == 0)
+        {
+            uint32_t position = static_cast<uint32_t>(symbols.size());
+            symbols.push_back(current.symbol);
+            follow.emplace_back();
+            results.push_back({false, {position}, {position}});
+            continue;
+        }
+        if (!expanded)
+        {
+            stack.emplace_back(index, true);
+            if (current.right != RegexAST::NONE)
+            {
+                stack.emplace_back(current.right, false);
+            }
+            stack.emplace_back(current.left, false);
+            continue;
+        }
+
+        if (current.op == '*')
+        {
+            Positions &child = results.back();
+            for (uint32_t p : child.last)
+            {
+                follow[p].insert(follow[p].end(), child.first.begin(), child.first.end());
+            }
+            child.nullable = true;
+            continue;
+        }
+
+        Positions right = std::move(results.back());
+        results.pop_back();
+        Positions &left = results.back();
+        if (current.op == '|')
+        {
+            left.nullable = left.nullable || right.nullable;
+            left.first = merge(left.first, right.first);
+            left.last = merge(left.last, right.last);
+        }
+        else
+        {
+            for (uint32_t p : left.last)
+            {
+                follow[p].insert(follow[p].end(), right.first.begin(), right.first.end());
+            }
+            if (left.nullable)
+            {
+                left.first = merge(left.first, right.first);
+            }
+            left.last = right.nullable ? merge(left.last, right.last) : std::move(right.last);
+            left.nullable = left.nullable && right.nullable;
+        }
+    }
+
+    const Positions &root = results.back();
+    FSA automaton(arena);
+    automaton.states.clear();
+    automaton.finalStates.clear();
+    automaton.finalStates.insert(root.last.begin(), root.last.end());
+    if (root.nullable)
+    {
+        automaton.finalStates.insert(0);
+    }
+
+    follow[0] = root.first;
+    for (uint32_t q = 0; q < symbols.size(); q++)
+    {
+        automaton.states.insert(q);
+        for (uint32_t p : follow[q])
+        {
+            automaton.addTransition(q, symbols[p], p);
+        }
+    }
+    automaton.nextState = symbols.size();
+    return automaton;
+}
+
+// Brzozowski construction: every state is a distinct normalized derivative of the expression and
+// is final when it accepts the empty word. Intersection, difference and complement are derived
+// directly, with no product of automata, and the result is already deterministic. Derivatives
+// equal to the empty language are the dead state and get no transitions. The transitions are
+// labelled with the classes of the symbols, the bytes the expression does not mention share one.
+FSA FSA::brzozowski(const RegexAST &ast, const Arena &arena)
+{
+    RegexTerms terms(ast);
+    uint32_t root = terms.fromAST(ast);
+
+    FSA automaton(arena);
+    automaton.states.clear();
+    automaton.finalStates.clear();
+
+    // class 0 of the alphabet stays EPSILON alone, the classes of the terms follow it in the order
+    // of their smallest byte. When the expression mentions every byte but NUL, the class of the
+    // unmentioned bytes is empty and gets no label, so at most 255 classes follow EPSILON.
+    std::vector<unsigned char> labels(terms.classes, 0);
+    std::vector<uint8_t> alphabetClass(terms.classes, 0);
+    automaton.alphabet.representatives.assign(1, 0);
+    automaton.alphabet.classOf[0] = 0;
+    for (size_t byte = 1; byte < 256; byte++)
+    {
+        uint8_t cls = terms.classOf[byte];
+        if (labels[cls] == 0)
+        {
+            labels[cls] = static_cast<unsigned char>(byte);
+            alphabetClass[cls] = static_cast<uint8_t>(automaton.alphabet.representatives.size());
+            automaton.alphabet.representatives.push_back(static_cast<unsigned char>(byte));
+        }
+        automaton.alphabet.classOf[byte] = alphabetClass[cls];
+    }
+
+    std::unordered_map<uint32_t, size_t> stateOf{{root, 0}};
+    std::vector<uint32_t> order{root};
+    for (size_t state = 0; state < order.size(); state++)
+    {
+        uint32_t term = order[state];
+        automaton.states.insert(state);
+        if (terms.nullable(term))
+        {
+            automaton.finalStates.insert(state);
+        }
+        for (size_t cls = 0; cls < terms.classes; cls++)
+        {
+            if (labels[cls] == 0)
+            {
+                continue;
+            }
+            uint32_t next = terms.derivative(term, static_cast<uint8_t>(cls));
+            if (next == RegexTerms::NOTHING)
+            {
+                continue;
+            }
+            auto [target, inserted] = stateOf.try_emplace(next, order.size());
+            if (inserted)
+            {
+                order.push_back(next);
+            }
+            automaton.addTransition(state, static_cast<char>(labels[cls]), target->second);
+        }
+    }
+    automaton.initialState = 0;
+    automaton.nextState = order.size();
+    return automaton;
+}
+
+void FSA::tag(uint32_t pattern)
+{
+    multiPattern = true;
+    acceptTags.clear();
+    for (const auto &finalState : finalStates)
+    {
+        acceptTags[finalState] = {pattern};
+    }
+}
+
+void FSA::unionWith(FSA &&other)
+{
+    if (sinkFinal || other.sinkFinal)
+    {
+        // an accepting sink cannot be shared by the branches of an NFA, so run them in step
+        product(other, Combination::Union);
+        return;
+    }
+
+    size_t otherInitialState = other.initialState;
+    std::vector<size_t> otherFinalStates(other.finalStates.begin(), other.finalStates.end());
+    multiPattern = multiPattern && other.multiPattern;
+    size_t base = splice(std::move(other));
+
+    size_t newInitialState = nextState++;
+    states.insert(newInitialState);
+    addTransition(newInitialState, EPSILON, initialState);
+    addTransition(newInitialState, EPSILON, base + otherInitialState);
+    initialState = newInitialState;
+
+    for (const auto &otherFinalState : otherFinalStates)
+    {
+        finalStates.insert(base + otherFinalState);
+    }
+}
+
+void FSA::concatenateWith(FSA &&other)
+{
+    materializeSink();
+    other.materializeSink();
+    size_t otherInitialState = other.initialState;
+    std::vector<size_t> otherFinalStates(other.finalStates.begin(), other.finalStates.end());
+    size_t base = splice(std::move(other));
+    acceptTags.clear();
+    multiPattern = false;
+
+    for (const auto &finalState : finalStates)
+    {
+        addTransition(finalState, EPSILON, base + otherInitialState);
+    }
+
+    finalStates.clear();
+    for (const auto &otherFinalState : otherFinalStates)
+    {
+        finalStates.insert(base + otherFinalState);
+    }
+}
+
+void FSA::kleene()
+{
+    materializeSink();
+    acceptTags.clear();
+    multiPattern = false;
     for (const auto &finalState : finalStates)
     {
-        copyTransitionsWithOffset(finalState, other, visited);
+        addTransition(finalState, EPSILON, initialState);
+    }
+
+    states.insert(nextState);
+    addTransition(nextState, EPSILON, initialState);
+    initialState = nextState++;
+
+    for (const auto &finalState : finalStates)
+    {
+        addTransition(finalState, EPSILON, nextState);
+    }
+
+    states.insert(nextState);
+    finalStates = {nextState++};
+
+    addTransition(initialState, EPSILON, *finalStates.begin());
+}
+
+void FSA::reverse()
+{
+    FSA_METRIC_PHASE(REVERSE);
+    if (sinkFinal)
+    {
+        // the reverse of a complement is the complement of the reverse
+        complement();
+        reverse();
+        complement();
+        return;
+    }
+    acceptTags.clear();
+    multiPattern = false;
+
+    TransitionMap newTransitions(resource());
+    for (const auto &[fromState, symbolToStates] : transitions)
+    {
+        for (const auto &[symbol, toStates] : symbolToStates)
+        {
+            for (const auto &toState : toStates)
+            {
+                newTransitions[toState][symbol].insert(fromState);
+            }
+        }
+    }
+
+    // every edge is turned around, so their number stays the same
+    transitions = std::move(newTransitions);
+
+    StateSet newFinalStates({initialState}, 0, resource());
+    initialState = nextState++;
+    states.insert(initialState);
+    for (const auto &finalState : finalStates)
+    {
+        addTransition(initialState, EPSILON, finalState);
+    }
+    finalStates = std::move(newFinalStates);
+}
+
+// Flipping the final states complements a DFA as long as the implicit sink is flipped with them,
+// so nothing is added to a partial DFA.
+void FSA::complement()
+{
+    if (!isDeterministic())
+    {
+        determinize();
+    }
+    acceptTags.clear();
+    multiPattern = false;
+    StateSet newFinalStates(resource());
+
+    for ( const auto &state : states )
+    {
+        if ( ! finalStates.count(state) )
+        {
+            newFinalStates.insert(state);
+        }
+    }
+
+    finalStates = std::move(newFinalStates);
+    sinkFinal = !sinkFinal;
+}
+
+// Replaces the implicit sink of a DFA that accepts by an explicit state with a transition on every
+// byte class, for the constructions that join it into an NFA. The classes are those of the
+// automaton's own transitions, so a state gets at most one new edge per class rather than per byte.
+void FSA::materializeSink()
+{
+    if (!sinkFinal)
+    {
+        return;
+    }
+    compressAlphabet();
+    alphabet.separateUnused();
+
+    size_t sink = nextState++;
+    states.insert(sink);
+    finalStates.insert(sink);
+    for (const auto &state : states)
+    {
+        auto &symbolToStates = transitions[state];
+        for (size_t cls = 1; cls < alphabet.size(); cls++)
+        {
+            char symbol = static_cast<char>(alphabet.representatives[cls]);
+            if (symbolToStates.count(symbol) == 0)
+            {
+                symbolToStates[symbol].insert(sink);
+                numberOfTransitions++;
+            }
+        }
+    }
+    sinkFinal = false;
+}
+
+// Relabels every transition with the representatives of the classes of finer that its class splits into.
+void FSA::refineAlphabet(const ByteClasses &finer)
+{
+    std::vector<std::vector<char>> labels(alphabet.size());
+    for (size_t cls = 1; cls < finer.size(); cls++)
+    {
+        unsigned char symbol = finer.representatives[cls];
+        labels[alphabet.classOf[symbol]].push_back(static_cast<char>(symbol));
+    }
+
+    TransitionMap newTransitions(resource());
+    for (auto &[fromState, symbolToStates] : transitions)
+    {
+        auto &newSymbolToStates = newTransitions[fromState];
+        for (auto &[symbol, toStates] : symbolToStates)
+        {
+            if (symbol == EPSILON)
+            {
+                newSymbolToStates[EPSILON] = std::move(toStates);
+                continue;
+            }
+            // the classes of finer that a class splits into are disjoint, so no edges merge
+            const std::vector<char> &split = labels[alphabet.classOf[static_cast<unsigned char>(symbol)]];
+            for (char label : split)
+            {
+                newSymbolToStates[label].insert(toStates.begin(), toStates.end());
+            }
+            numberOfTransitions += toStates.size() * (split.size() - 1);
+        }
+    }
+    transitions = std::move(newTransitions);
+    alphabet = finer;
+}
+
+// The operators that join two automata compare their labels, so both are relabelled over the
+// classes that refine the alphabets of the two. Those are the classes of their own transitions:
+// a byte that only one of them uses is split off in the other, not every byte.
+void FSA::shareAlphabet(FSA &other)
+{
+    if (alphabet.classOf == other.alphabet.classOf && alphabet.representatives == other.alphabet.representatives)
+    {
+        return;
+    }
+    compressAlphabet();
+    other.compressAlphabet();
+    ByteClasses common = ByteClasses::meet(alphabet, other.alphabet);
+    refineAlphabet(common);
+    other.refineAlphabet(common);
+}
+
+bool FSA::isDeterministic() const
+{
+    for (const auto &[fromState, symbolToStates] : transitions)
+    {
+        for (const auto &[symbol, toStates] : symbolToStates)
+        {
+            if (symbol == EPSILON || toStates.size() > 1)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// states of a DFA that differ from the implicit sink, the ones that can reach a state which
+// accepts when the sink rejects or the other way around
+std::unordered_set<size_t> FSA::liveStates() const
+{
+    std::unordered_map<size_t, std::vector<size_t>> predecessors;
+    for (const auto &[fromState, symbolToStates] : transitions)
+    {
+        for (const auto &[symbol, toStates] : symbolToStates)
+        {
+            for (const auto &toState : toStates)
+            {
+                predecessors[toState].push_back(fromState);
+            }
+        }
     }
 
-    finalStates = {};
-    if (other.finalStates.size() != 1)
+    std::unordered_set<size_t> live;
+    std::vector<size_t> stack;
+    for (const auto &state : states)
     {
-        // std::cerr << "undefined behav concat2" << '\n';
+        if (finalStates.count(state) != sinkFinal)
+        {
+            live.insert(state);
+            stack.push_back(state);
+        }
     }
-    for (const auto &otherFinalState : other.finalStates)
+    while (!stack.empty())
     {
-        finalStates.insert(visited[otherFinalState]);
-        nextState = visited[otherFinalState] + other.nextState;
+        size_t state = stack.back();
+        stack.pop_back();
+        for (const auto &fromState : predecessors[state])
+        {
+            if (live.insert(fromState).second)
+            {
+                stack.push_back(fromState);
+            }
+        }
     }
+    return live;
+}
 
-    // auto end = std::chrono::high_resolution_clock::now();
-    // std::cerr << "concatenation took: " << end.time_since_epoch().count() - start.time_since_epoch().count() << " nanoseconds\n";
+void FSA::intersect(FSA &&other)
+{
+    product(other, Combination::Intersection);
 }
 
-void FSA::kleene()
+void FSA::difference(FSA &&other)
+{
+    product(other, Combination::Difference);
+}
+
+// Product of the two determinized automata, restricted to the pairs reachable from the pair of
+// initial states. States that behave like the implicit sink of their automaton are replaced by
+// SINK, and a pair in which one side is SINK becomes the sink of the product when the combination
+// no longer depends on the other side. So the missing transitions of partial DFAs stay missing
+// whether their sinks accept or not. The right automaton is an operand being consumed, so it is
+// determinized in place.
+void FSA::product(FSA &other, Combination combination)
 {
-    if (finalStates.size() != 1)
+    FSA_METRIC_PHASE(PRODUCT);
+    constexpr size_t SINK = SIZE_MAX;
+
+    if (!isDeterministic())
     {
-        // std::cerr << "undefined behav union" << '\n';
+        determinize();
     }
-    for (const auto &finalState : finalStates)
+    if (!other.isDeterministic())
     {
-        transitions[finalState][EPSILON].insert(initialState);
+        other.determinize();
     }
+    shareAlphabet(other);
+    const FSA *right = &other;
 
-    states.insert(nextState);
-    transitions[nextState][EPSILON].insert(initialState);
-    initialState = nextState++;
+    auto combine = [combination](bool left, bool right)
+    {
+        switch (combination)
+        {
+        case Combination::Intersection:
+            return left && right;
+        case Combination::Difference:
+            return left && !right;
+        default:
+            return left || right;
+        }
+    };
+    bool leftDecides = combine(sinkFinal, false) == combine(sinkFinal, true);
+    bool rightDecides = combine(false, right->sinkFinal) == combine(true, right->sinkFinal);
 
-    for (const auto &finalState : finalStates)
+    auto leftLive = liveStates();
+    auto rightLive = right->liveStates();
+
+    auto step = [](const FSA &automaton, const std::unordered_set<size_t> &live, size_t state, char symbol)
+    {
+        if (state == SINK)
+        {
+            return SINK;
+        }
+        auto it = automaton.transitions.find(state);
+        if (it == automaton.transitions.end() || it->second.count(symbol) == 0)
+        {
+            return SINK;
+        }
+        size_t toState = *it->second.at(symbol).begin();
+        return live.count(toState) ? toState : SINK;
+    };
+    auto isSink = [&](size_t leftState, size_t rightState)
+    {
+        return (leftState == SINK && (leftDecides || rightState == SINK)) || (rightState == SINK && rightDecides);
+    };
+
+    std::unordered_map<std::pair<size_t, size_t>, size_t, StatePairHash> pairID;
+    std::queue<std::pair<size_t, size_t>> unmarkedPairs;
+    TransitionMap newTransitions(resource());
+    size_t newTransitionCount = 0;
+    StateSet newFinalStates(resource());
+    bool newSinkFinal = combine(sinkFinal, right->sinkFinal);
+
+    auto initialPair = std::make_pair(leftLive.count(initialState) ? initialState : SINK,
+                                      rightLive.count(right->initialState) ? right->initialState : SINK);
+    if (!isSink(initialPair.first, initialPair.second))
     {
-        transitions[finalState][EPSILON].insert(nextState);
+        pairID[initialPair] = 0;
+        unmarkedPairs.push(initialPair);
+    }
+    else if (newSinkFinal)
+    {
+        // one final state with no transitions, the sink accepts the rest
+        newFinalStates.insert(0);
     }
 
-    states.insert(nextState);
-    finalStates = {nextState++};
+    std::vector<char> symbols;
+    auto addSymbols = [&symbols](const FSA &automaton, size_t state)
+    {
+        auto it = state == SINK ? automaton.transitions.end() : automaton.transitions.find(state);
+        if (it != automaton.transitions.end())
+        {
+            for (const auto &[symbol, toStates] : it->second)
+            {
+                symbols.push_back(symbol);
+            }
+        }
+    };
+    while (!unmarkedPairs.empty())
+    {
+        auto [leftState, rightState] = unmarkedPairs.front();
+        unmarkedPairs.pop();
+        size_t id = pairID[{leftState, rightState}];
+
+        bool leftAccepts = leftState == SINK ? sinkFinal : finalStates.count(leftState) != 0;
+        bool rightAccepts = rightState == SINK ? right->sinkFinal : right->finalStates.count(rightState) != 0;
+        if (combine(leftAccepts, rightAccepts))
+        {
+            newFinalStates.insert(id);
+        }
+
+        // a symbol missing on both sides leads both to their sinks
+        symbols.clear();
+        addSymbols(*this, leftState);
+        addSymbols(*right, rightState);
+        std::sort(symbols.begin(), symbols.end());
+        symbols.erase(std::unique(symbols.begin(), symbols.end()), symbols.end());
+
+        for (char symbol : symbols)
+        {
+            size_t leftNext = step(*this, leftLive, leftState, symbol);
+            size_t rightNext = step(*right, rightLive, rightState, symbol);
+            if (isSink(leftNext, rightNext))
+            {
+                continue;
+            }
+
+            auto [target, inserted] = pairID.emplace(std::make_pair(leftNext, rightNext), pairID.size());
+            if (inserted)
+            {
+                unmarkedPairs.push(target->first);
+            }
+            newTransitions[id][symbol] = {target->second};
+            newTransitionCount++;
+        }
+    }
 
-    transitions[initialState][EPSILON].insert(finalStates.begin(), finalStates.end());
+    initialState = 0;
+    states.clear();
+    for (size_t state = 0; state < std::max<size_t>(pairID.size(), 1); state++)
+    {
+        states.insert(state);
+    }
+    nextState = states.size();
+    finalStates = std::move(newFinalStates);
+    sinkFinal = newSinkFinal;
+    acceptTags.clear();
+    multiPattern = false;
+    transitions = std::move(newTransitions);
+    numberOfTransitions = newTransitionCount;
 }
 
-void FSA::reverse()
+DenseNFA FSA::toDenseNFA() const
 {
-    auto timeStart = std::chrono::high_resolution_clock::now();
+    DenseNFA nfa;
+
+    std::unordered_map<size_t, uint32_t> index;
+    std::vector<size_t> stateOf;
+    auto number = [&](size_t state)
+    {
+        auto [it, inserted] = index.emplace(state, static_cast<uint32_t>(stateOf.size()));
+        if (inserted)
+        {
+            stateOf.push_back(state);
+        }
+        return it->second;
+    };
 
-    std::unordered_map<size_t, std::unordered_map<char, std::unordered_set<size_t>>> newTransitions;
+    nfa.initialState = number(initialState);
+    for (const auto &state : states)
+    {
+        number(state);
+    }
     for (const auto &[fromState, symbolToStates] : transitions)
     {
-        for (const auto &[symbol, toStates] : symbolToStates)
+        number(fromState);
+        for (const auto &[symbol, toStates] : symbolToStates)
+        {
+            for (const auto &toState : toStates)
+            {
+                number(toState);
+            }
+        }
+    }
+
+    uint32_t n = static_cast<uint32_t>(stateOf.size());
+    nfa.finalStates.assign(n, false);
+    for (const auto &finalState : finalStates)
+    {
+        nfa.finalStates[number(finalState)] = true;
+    }
+    for (const auto &[state, tags] : acceptTags)
+    {
+        if (finalStates.count(state))
+        {
+            nfa.acceptTags[number(state)].assign(tags.begin(), tags.end());
+        }
+    }
+
+    std::vector<uint32_t> epsilonStart(n + 1, 0), epsilonTargets;
+    std::vector<std::pair<char, uint32_t>> moves;
+    nfa.moveStart.assign(n + 1, 0);
+    for (uint32_t q = 0; q < n; q++)
+    {
+        moves.clear();
+        auto it = transitions.find(stateOf[q]);
+        if (it != transitions.end())
+        {
+            for (const auto &[symbol, toStates] : it->second)
+            {
+                for (const auto &toState : toStates)
+                {
+                    if (symbol == EPSILON)
+                    {
+                        epsilonTargets.push_back(index[toState]);
+                    }
+                    else
+                    {
+                        moves.emplace_back(symbol, index[toState]);
+                    }
+                }
+            }
+        }
+        std::sort(moves.begin(), moves.end());
+        for (const auto &[symbol, toState] : moves)
+        {
+            nfa.moveSymbols.push_back(symbol);
+            nfa.moveTargets.push_back(toState);
+        }
+        nfa.moveStart[q + 1] = static_cast<uint32_t>(nfa.moveTargets.size());
+        epsilonStart[q + 1] = static_cast<uint32_t>(epsilonTargets.size());
+    }
+
+    nfa.removeEpsilons(epsilonStart, epsilonTargets);
+    return nfa;
+}
+
+void FSA::determinize(size_t threads)
+{
+    FSA_METRIC_PHASE(DETERMINIZE);
+    // Use the power-set construction to create a deterministic FSA
+    FSA_METRIC_SET(nfaStates, stateCount());
+    DenseNFA nfa = toDenseNFA();
+    FSA_METRIC_SET(epsilonFreeStates, nfa.size());
+    FSA_METRIC_SET(nfaTransitions, transitionCount());
+
+    TransitionMap newTransitions(resource());
+    StateSet newFinalStates(resource());
+    TagMap newTags(resource());
+    size_t count = threads == 1 ? subsetConstruction(nfa, newTransitions, newFinalStates, newTags)
+                                : parallelSubsetConstruction(nfa, threads, newTransitions, newFinalStates, newTags);
+
+    this->initialState = 0;
+    this->states.clear();
+    for (size_t state = 0; state < count; state++)
+    {
+        this->states.insert(state);
+    }
+    this->nextState = count;
+    this->finalStates = std::move(newFinalStates);
+    this->acceptTags = std::move(newTags);
+    this->transitions = std::move(newTransitions);
+    // every label of a DFA has a single target
+    this->numberOfTransitions = 0;
+    for (const auto &[fromState, symbolToStates] : this->transitions)
+    {
+        this->numberOfTransitions += symbolToStates.size();
+    }
+
+    FSA_METRIC_SET(dfaStates, states.size());
+    FSA_METRIC_SET(dfaTransitions, transitionCount());
+}
+
+size_t FSA::subsetConstruction(const DenseNFA &nfa, TransitionMap &newTransitions, StateSet &newFinalStates,
+                               TagMap &newTags)
+{
+    StateSetArena subsets;
+    SubsetSuccessors successors(nfa.size());
+    subsets.intern({nfa.initialState});
+
+    // subsets get their IDs in discovery order, so the unmarked ones are exactly the IDs not yet visited
+    for (uint32_t currentState = 0; currentState < subsets.size(); currentState++)
+    {
+        auto onMove = [&](char symbol, const std::vector<uint32_t> &successor)
+        {
+            auto [target, inserted] = subsets.intern(successor);
+            newTransitions[currentState][symbol] = {target};
+            FSA_METRIC_ADD(subsetLookups, 1);
+            FSA_METRIC_ADD(subsetHits, !inserted);
+        };
+        // read before expanding, which may move the members
+        std::vector<uint32_t> tags = nfa.tagsOf(subsets.begin(currentState), subsets.end(currentState));
+        if (successors.expand(nfa, subsets.begin(currentState), subsets.end(currentState), onMove))
+        {
+            newFinalStates.insert(currentState);
+        }
+        if (!tags.empty())
+        {
+            newTags[currentState].assign(tags.begin(), tags.end());
+        }
+    }
+    return subsets.size();
+}
+
+// Every worker owns a deque of subsets to expand and steals from the front of the other deques
+// when its own runs dry. Successors are interned in a table split into shards with a lock each,
+// which hands out provisional IDs; the result is renumbered breadth-first at the end, so it is
+// the same DFA with the same numbering as the sequential construction.
+size_t FSA::parallelSubsetConstruction(const DenseNFA &nfa, size_t threads, TransitionMap &newTransitions,
+                                       StateSet &newFinalStates, TagMap &newTags)
+{
+    constexpr size_t SHARD_BITS = 6;
+    constexpr size_t SHARDS = size_t(1) << SHARD_BITS;
+
+    struct Shard
+    {
+        std::mutex lock;
+        StateSetArena subsets;
+    };
+    struct Task
+    {
+        uint64_t id;
+        std::vector<uint32_t> members;
+    };
+    struct Move
+    {
+        uint64_t from;
+        uint64_t to;
+        char symbol;
+    };
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+        std::vector<Move> moves;
+        std::vector<uint64_t> finals;
+        std::vector<std::pair<uint64_t, std::vector<uint32_t>>> tags;
+        size_t lookups = 0;
+        size_t hits = 0;
+    };
+
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::vector<Shard> shards(SHARDS);
+    std::vector<Worker> workers(threads);
+    // subsets interned but not expanded yet; the workers stop when it drops to zero
+    std::atomic<size_t> pending(1);
+
+    // provisional IDs carry their shard in the low bits
+    auto intern = [&](const std::vector<uint32_t> &subset)
+    {
+        uint64_t h = StateSetArena::hash(subset.data(), subset.size());
+        size_t shard = h >> (64 - SHARD_BITS);
+        std::lock_guard<std::mutex> guard(shards[shard].lock);
+        auto [local, inserted] = shards[shard].subsets.intern(subset, h);
+        return std::make_pair(static_cast<uint64_t>(local) << SHARD_BITS | shard, inserted);
+    };
+
+    // the owner takes the newest task of its deque, thieves the oldest one of another deque
+    auto take = [&](size_t self, Task &task)
+    {
+        for (size_t i = 0; i < threads; i++)
+        {
+            Worker &victim = workers[(self + i) % threads];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.tasks.empty())
+            {
+                continue;
+            }
+            if (i == 0)
+            {
+                task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    };
+
+    auto run = [&](size_t self)
+    {
+        Worker &worker = workers[self];
+        SubsetSuccessors successors(nfa.size());
+        Task task;
+        while (pending.load(std::memory_order_acquire) != 0)
+        {
+            if (!take(self, task))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            auto onMove = [&](char symbol, const std::vector<uint32_t> &successor)
+            {
+                auto [target, inserted] = intern(successor);
+                worker.moves.push_back({task.id, target, symbol});
+                worker.lookups++;
+                worker.hits += !inserted;
+                if (inserted)
+                {
+                    pending.fetch_add(1, std::memory_order_relaxed);
+                    std::lock_guard<std::mutex> guard(worker.lock);
+                    worker.tasks.push_back({target, successor});
+                }
+            };
+            std::vector<uint32_t> tags = nfa.tagsOf(task.members.data(), task.members.data() + task.members.size());
+            if (successors.expand(nfa, task.members.data(), task.members.data() + task.members.size(), onMove))
+            {
+                worker.finals.push_back(task.id);
+            }
+            if (!tags.empty())
+            {
+                worker.tags.emplace_back(task.id, std::move(tags));
+            }
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    };
+
+    std::vector<uint32_t> start{nfa.initialState};
+    uint64_t initial = intern(start).first;
+    workers[0].tasks.push_back({initial, start});
+
+    std::vector<std::thread> pool;
+    for (size_t self = 1; self < threads; self++)
+    {
+        pool.emplace_back(run, self);
+    }
+    run(0);
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+
+    // dense provisional numbering, shard by shard
+    std::array<size_t, SHARDS + 1> base{};
+    for (size_t shard = 0; shard < SHARDS; shard++)
+    {
+        base[shard + 1] = base[shard] + shards[shard].subsets.size();
+    }
+    size_t count = base[SHARDS];
+    auto dense = [&](uint64_t id)
+    {
+        return static_cast<uint32_t>(base[id & (SHARDS - 1)] + (id >> SHARD_BITS));
+    };
+
+    // group the moves by their source; a subset was expanded by one worker in symbol order and the
+    // grouping is stable, so every row stays sorted by symbol
+    std::vector<uint32_t> rowStart(count + 1, 0);
+    std::vector<bool> final(count, false);
+    for (const auto &worker : workers)
+    {
+        for (const auto &move : worker.moves)
+        {
+            rowStart[dense(move.from) + 1]++;
+        }
+        for (uint64_t id : worker.finals)
+        {
+            final[dense(id)] = true;
+        }
+        FSA_METRIC_ADD(subsetLookups, worker.lookups);
+        FSA_METRIC_ADD(subsetHits, worker.hits);
+    }
+    for (size_t q = 0; q < count; q++)
+    {
+        rowStart[q + 1] += rowStart[q];
+    }
+    std::vector<std::pair<char, uint32_t>> rows(rowStart[count]);
+    std::vector<uint32_t> cursor(rowStart.begin(), rowStart.end() - 1);
+    for (const auto &worker : workers)
+    {
+        for (const auto &move : worker.moves)
+        {
+            rows[cursor[dense(move.from)]++] = {move.symbol, dense(move.to)};
+        }
+    }
+
+    // breadth-first renumbering in symbol order gives the IDs of the sequential construction
+    std::vector<uint32_t> canonical(count, UINT32_MAX);
+    std::vector<uint32_t> order = {dense(initial)};
+    canonical[order[0]] = 0;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        uint32_t q = order[i];
+        if (final[q])
+        {
+            newFinalStates.insert(i);
+        }
+        for (uint32_t j = rowStart[q]; j < rowStart[q + 1]; j++)
+        {
+            auto [symbol, to] = rows[j];
+            if (canonical[to] == UINT32_MAX)
+            {
+                canonical[to] = static_cast<uint32_t>(order.size());
+                order.push_back(to);
+            }
+            newTransitions[i][symbol] = {canonical[to]};
+        }
+    }
+    for (const auto &worker : workers)
+    {
+        for (const auto &[id, tags] : worker.tags)
+        {
+            newTags[canonical[dense(id)]].assign(tags.begin(), tags.end());
+        }
+    }
+    return count;
+}
+
+void FSA::minimize(size_t threads, Minimization mode)
+{
+    FSA_METRIC_PHASE(MINIMIZE);
+    // number the states that are reachable from the initial state and can reach a state whose
+    // finality differs from the implicit sink, the rest behave like the sink and are dropped
+    std::unordered_map<size_t, uint32_t> index;
+    std::vector<size_t> stateOf;
+    std::vector<uint32_t> tails, heads;
+    std::vector<unsigned char> labels;
+
+    index[initialState] = 0;
+    stateOf.push_back(initialState);
+    for (size_t i = 0; i < stateOf.size(); i++)
+    {
+        auto it = transitions.find(stateOf[i]);
+        if (it == transitions.end())
+        {
+            continue;
+        }
+        for (const auto &[symbol, toStates] : it->second)
+        {
+            for (const auto &toState : toStates)
+            {
+                auto [target, inserted] = index.emplace(toState, static_cast<uint32_t>(stateOf.size()));
+                if (inserted)
+                {
+                    stateOf.push_back(toState);
+                }
+                tails.push_back(static_cast<uint32_t>(i));
+                labels.push_back(static_cast<unsigned char>(symbol));
+                heads.push_back(target->second);
+            }
+        }
+    }
+
+    std::vector<uint32_t> incomingStart(stateOf.size() + 1, 0), incoming(tails.size());
+    for (uint32_t head : heads)
+    {
+        incomingStart[head + 1]++;
+    }
+    for (size_t q = 0; q < stateOf.size(); q++)
+    {
+        incomingStart[q + 1] += incomingStart[q];
+    }
+    std::vector<uint32_t> fill(incomingStart.begin(), incomingStart.end() - 1);
+    for (uint32_t t = 0; t < tails.size(); t++)
+    {
+        incoming[fill[heads[t]]++] = t;
+    }
+
+    std::vector<bool> relevant(stateOf.size(), false);
+    std::vector<uint32_t> stack;
+    for (uint32_t q = 0; q < stateOf.size(); q++)
+    {
+        if (finalStates.count(stateOf[q]) != sinkFinal)
+        {
+            relevant[q] = true;
+            stack.push_back(q);
+        }
+    }
+    while (!stack.empty())
+    {
+        uint32_t q = stack.back();
+        stack.pop_back();
+        for (uint32_t i = incomingStart[q]; i < incomingStart[q + 1]; i++)
+        {
+            uint32_t p = tails[incoming[i]];
+            if (!relevant[p])
+            {
+                relevant[p] = true;
+                stack.push_back(p);
+            }
+        }
+    }
+
+    // the language is empty, or everything when the sink accepts
+    auto becomeSink = [this]()
+    {
+        initialState = 0;
+        states = {0};
+        nextState = 1;
+        finalStates.clear();
+        if (sinkFinal)
+        {
+            finalStates.insert(0);
+        }
+        acceptTags.clear();
+        transitions.clear();
+        numberOfTransitions = 0;
+        FSA_METRIC_SET(minimizedStates, 1);
+        FSA_METRIC_SET(minimizedTransitions, 0);
+    };
+    if (!relevant[0])
+    {
+        becomeSink();
+        return;
+    }
+
+    // compact numbering of the relevant states and transitions
+    std::vector<uint32_t> compact(stateOf.size());
+    uint32_t n = 0;
+    for (uint32_t q = 0; q < stateOf.size(); q++)
+    {
+        if (relevant[q])
+        {
+            stateOf[n] = stateOf[q];
+            compact[q] = n++;
+        }
+    }
+    stateOf.resize(n);
+
+    uint32_t m = 0;
+    for (uint32_t t = 0; t < tails.size(); t++)
+    {
+        if (relevant[tails[t]] && relevant[heads[t]])
+        {
+            tails[m] = compact[tails[t]];
+            heads[m] = compact[heads[t]];
+            labels[m++] = labels[t];
+        }
+    }
+    tails.resize(m);
+    heads.resize(m);
+    labels.resize(m);
+
+    // states that are not final are in accept class 0, final states in one class per set of tags,
+    // so that states accepting different patterns are never merged
+    std::vector<uint32_t> accept(n, 0);
+    std::map<std::vector<uint32_t>, uint32_t> acceptClass;
+    for (uint32_t q = 0; q < n; q++)
+    {
+        if (finalStates.count(stateOf[q]))
         {
-            for (const auto &toState : toStates)
+            auto it = acceptTags.find(stateOf[q]);
+            std::vector<uint32_t> tags;
+            if (it != acceptTags.end())
             {
-                newTransitions[toState][symbol].insert(fromState);
+                tags.assign(it->second.begin(), it->second.end());
             }
+            accept[q] = acceptClass.emplace(std::move(tags), acceptClass.size() + 1).first->second;
         }
     }
 
-    transitions = newTransitions;
-
-    std::unordered_set<size_t> newFinalStates = {initialState};
-    initialState = nextState++;
-    states.insert(initialState);
-    transitions[initialState][EPSILON].insert(finalStates.begin(), finalStates.end());
-    finalStates = newFinalStates;
-
-    auto timeEnd = std::chrono::high_resolution_clock::now();
-    std::cerr << "reverse took: " << timeEnd.time_since_epoch().count() - timeStart.time_since_epoch().count() << " nanoseconds\n";
-}
-
-void FSA::complement()
-{
-    std::unordered_set<size_t> newFinalStates;
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // the automatic mode runs Moore rounds on large DFAs while they keep splitting blocks quickly and
+    // then lets Valmari-Lehtinen refine the blocks found so far
+    std::vector<uint32_t> blockOf = std::move(accept);
+    bool parallel = mode == Minimization::Parallel ||
+                    (mode == Minimization::Automatic && threads > 1 && m >= PARALLEL_MINIMIZE_TRANSITIONS);
+    if (!parallel || !mooreRefinement(blockOf, tails, labels, heads, threads, mode == Minimization::Automatic))
+    {
+        blockOf = valmariLehtinen(blockOf, tails, labels, heads);
+    }
 
-    for ( const auto &state : states )
+    // Besides the implicit sink, a block that loops to itself on every byte but NUL (which no
+    // transition carries) is the only other place a DFA can stay forever; its finality is the
+    // opposite of the sink's, or it would have been dropped with the states that behave like the
+    // sink. At most one of the two is kept explicit so that every construction of a language ends
+    // up with the same DFA: the rejecting one is the sink when both are reachable, the looping
+    // block is folded into the sink when nothing reaches the sink, and an unreachable sink rejects.
+    constexpr uint32_t NO_BLOCK = UINT32_MAX;
+    size_t byteClasses = alphabet.size() - 1 + (alphabet.members(EPSILON).size() > 1);
+    std::vector<uint32_t> degree(n, 0);
+    std::vector<bool> loops(n, true);
+    for (uint32_t t = 0; t < m; t++)
     {
-        if ( ! finalStates.count(state) )
+        degree[tails[t]]++;
+        loops[tails[t]] = loops[tails[t]] && blockOf[heads[t]] == blockOf[tails[t]];
+    }
+    bool sinkReachable = false;
+    uint32_t looping = NO_BLOCK;
+    for (uint32_t q = 0; q < n; q++)
+    {
+        if (degree[q] < byteClasses)
         {
-            newFinalStates.insert(state);
+            sinkReachable = true;
+        }
+        else if (loops[q] && !multiPattern)
+        {
+            looping = blockOf[q];
         }
     }
-
-    finalStates = newFinalStates;
-}
-
-void FSA::intersect( const FSA& other )
-{
-    other.print();
-}
-
-void FSA::difference(const FSA& other)
-{
-    FSA c(other);
-    c.complement();
-    intersect(c);
-}
-
-std::unordered_set<size_t> FSA::epsilonClosure(const std::unordered_set<size_t> &states) const
-// std::set<size_t> FSA::epsilonClosure(size_t state, std::unordered_map<size_t, std::unordered_set<size_t>> &epsilon_transitions)
-{
-
-    // auto timeStart = std::chrono::high_resolution_clock::now();
-
-    std::unordered_set<size_t> closure = states;
-
-    std::stack<size_t> stack;
-    for (const auto &state : states)
+    if (looping != NO_BLOCK && sinkReachable && sinkFinal)
     {
-        stack.push(state);
+        // the accepting sink becomes a looping state and the rejecting block, now like the sink, goes
+        materializeSink();
+        minimize(threads, mode);
+        return;
     }
-
-    while (!stack.empty())
+    if (looping != NO_BLOCK && !sinkReachable)
     {
-        size_t state = stack.top();
-        stack.pop();
-
-        // assuming epsilon transitions are represented by a special character, for example '#'
-        if (transitions.count(state) && transitions.at(state).count('\0'))
+        sinkFinal = !sinkFinal;
+        if (blockOf[0] == looping)
         {
-            for (const auto &newState : transitions.at(state).at('\0'))
-            {
-                if (closure.insert(newState).second)
-                {
-                    stack.push(newState);
-                }
-            }
+            becomeSink();
+            return;
         }
     }
+    else
+    {
+        looping = NO_BLOCK;
+        sinkFinal = sinkFinal && sinkReachable;
+    }
 
-    // auto timeEnd = std::chrono::high_resolution_clock::now();
-    // std::cerr << "epsilon closure took: " << timeEnd.time_since_epoch().count() - timeStart.time_since_epoch().count() << " nanoseconds\n";
+    std::unordered_map<size_t, size_t> partition;
+    for (uint32_t q = 0; q < n; q++)
+    {
+        // the transitions into a folded block are dropped with it and lead to the sink instead
+        if (blockOf[q] != looping)
+        {
+            partition[stateOf[q]] = blockOf[q] - (looping != NO_BLOCK && blockOf[q] > looping);
+        }
+    }
 
-    // epsilon_transitions[state] = closure;
+    // Now merge states in the same partition and update the transitions
+    mergeStates(partition);
 
-    return closure;
+    FSA_METRIC_SET(minimizedStates, states.size());
+    FSA_METRIC_SET(minimizedTransitions, transitionCount());
 }
 
-std::string setToString(std::set<size_t> &s)
+// Valmari-Lehtinen: the partition of the states into blocks is refined against the partition
+// of the transitions into cords, in O(m log n). The initial blocks are the classes in accept, the
+// accept classes of the states or any partition that refines them. Returns the block of every state.
+std::vector<uint32_t> FSA::valmariLehtinen(const std::vector<uint32_t> &accept, const std::vector<uint32_t> &tails,
+                                           const std::vector<unsigned char> &labels, const std::vector<uint32_t> &heads)
 {
-    std::string res = "";
-    for (const auto &state : s)
+    uint32_t n = static_cast<uint32_t>(accept.size());
+    uint32_t m = static_cast<uint32_t>(tails.size());
+
+    std::vector<uint32_t> incomingStart(n + 1, 0), incoming(m);
+    for (uint32_t head : heads)
     {
-        res += std::to_string(state) + ",";
+        incomingStart[head + 1]++;
     }
-    return res;
-}
-
-void FSA::determinize()
-{
-    auto timeStart = std::chrono::high_resolution_clock::now();
-    // Use the power-set construction to create a deterministic FSA
-    FSA dFSA;
-    dFSA.initialState = 0;
-
-    // std::unordered_map<std::unordered_set<size_t>, std::unordered_set<size_t>, StateSetHash, StateSetEqual> epsilonCache;
-
-    std::queue<std::unordered_set<size_t>> unmarkedStates;
-    auto initialClosure = epsilonClosure({initialState});
-    // epsilonCache[{initialState}] = initialClosure;
-
-    unmarkedStates.push(initialClosure);
-
-    std::unordered_map<std::unordered_set<size_t>, size_t, StateSetHash, StateSetEqual> stateMapping;
-
-    size_t stateID = 0;
-    stateMapping[initialClosure] = stateID++;
-
-    // StateSetEqual sse;
-
-    while (!unmarkedStates.empty())
+    for (uint32_t q = 0; q < n; q++)
+    {
+        incomingStart[q + 1] += incomingStart[q];
+    }
+    std::vector<uint32_t> fill(incomingStart.begin(), incomingStart.end() - 1);
+    for (uint32_t t = 0; t < m; t++)
     {
-        // std::cerr << "queue size: " << unmarkedStates.size() << '\n';
-        // std::cerr << "cache size: " << epsilonCache.size() << '\n';
-        // std::cerr << "map size: " << stateMapping.size() << '\n';
+        incoming[fill[heads[t]]++] = t;
+    }
 
-        auto currentState = unmarkedStates.front();
-        unmarkedStates.pop();
+    std::vector<uint32_t> marked(std::max(n, m) + 1, 0), touched(std::max(n, m) + 1, 0);
+    RefinablePartition blocks(n, marked, touched);
+    RefinablePartition cords(m, marked, touched);
 
-        if (std::any_of(currentState.begin(), currentState.end(), [&](size_t s)
-                        { return finalStates.count(s); }))
+    // split off the final states one accept class at a time, bucketed by class
+    uint32_t classes = n ? *std::max_element(accept.begin(), accept.end()) + 1 : 1;
+    std::vector<uint32_t> classStart(classes + 1, 0), byClass(n);
+    for (uint32_t q = 0; q < n; q++)
+    {
+        classStart[accept[q] + 1]++;
+    }
+    for (uint32_t c = 0; c < classes; c++)
+    {
+        classStart[c + 1] += classStart[c];
+    }
+    std::vector<uint32_t> classFill(classStart.begin(), classStart.end() - 1);
+    for (uint32_t q = 0; q < n; q++)
+    {
+        byClass[classFill[accept[q]]++] = q;
+    }
+    for (uint32_t c = 1; c < classes; c++)
+    {
+        for (uint32_t i = classStart[c]; i < classStart[c + 1]; i++)
         {
-            dFSA.finalStates.insert(stateMapping[currentState]);
+            blocks.mark(byClass[i]);
         }
+        blocks.split();
+    }
 
-        for (char ch = 'a'; ch <= 'z'; ch++)
+    // initial cords group the transitions by label, bucketed in linear time
+    if (m)
+    {
+        std::vector<uint32_t> labelStart(257, 0);
+        for (unsigned char label : labels)
+        {
+            labelStart[label + 1]++;
+        }
+        for (size_t a = 0; a < 256; a++)
+        {
+            labelStart[a + 1] += labelStart[a];
+        }
+        std::vector<uint32_t> cursor(labelStart.begin(), labelStart.end() - 1);
+        for (uint32_t t = 0; t < m; t++)
+        {
+            uint32_t position = cursor[labels[t]]++;
+            cords.elements[position] = t;
+            cords.location[t] = position;
+        }
+        cords.sets = 0;
+        for (size_t a = 0; a < 256; a++)
         {
-            std::unordered_set<size_t> newState;
-            for (const auto &state : currentState)
+            if (labelStart[a] == labelStart[a + 1])
             {
-                if (transitions.count(state) && transitions.at(state).count(ch))
-                {
-                    for (const auto &next : transitions.at(state).at(ch))
-                    {
-                        // if (epsilonCache.count({next}))
-                        // {
-                        // auto eClosure = epsilonCache[{next}];
-                        // newState.insert(eClosure.begin(), eClosure.end());
-                        // }
-                        // else
-                        // {
-                        auto eClosure = epsilonClosure({next});
-                        // epsilonCache[{next}] = eClosure;
-                        newState.insert(eClosure.begin(), eClosure.end());
-                        // }
-                    }
-                }
-            }
-
-            if (newState.empty())
                 continue;
-
-            if (stateMapping.count(newState) == 0)
+            }
+            cords.first[cords.sets] = labelStart[a];
+            cords.past[cords.sets] = labelStart[a + 1];
+            for (uint32_t i = labelStart[a]; i < labelStart[a + 1]; i++)
             {
-                stateMapping[newState] = stateID++;
-                unmarkedStates.push(newState);
+                cords.setOf[cords.elements[i]] = cords.sets;
             }
-
-            // if (!sse(currentState, newState))
-            // {
-            //     unmarkedStates.push(newState);
-            // }
-
-            dFSA.transitions[stateMapping[currentState]][ch] = {stateMapping[newState]};
+            cords.sets++;
         }
     }
 
-    dFSA.states = std::unordered_set<size_t>(dFSA.finalStates.begin(), dFSA.finalStates.end());
-    size_t transitions_count = 0;
-    for (const auto &[fromState, symbolToStates] : dFSA.transitions)
+    uint32_t b = 1, c = 0;
+    while (c < cords.sets)
     {
-        dFSA.states.insert(fromState);
-        for (const auto &[symbol, toStates] : symbolToStates)
+        for (uint32_t i = cords.first[c]; i < cords.past[c]; i++)
         {
-            for (const auto &toState : toStates)
+            blocks.mark(tails[cords.elements[i]]);
+        }
+        blocks.split();
+        c++;
+
+        while (b < blocks.sets)
+        {
+            for (uint32_t i = blocks.first[b]; i < blocks.past[b]; i++)
             {
-                dFSA.states.insert(toState);
-                ++transitions_count;
+                uint32_t q = blocks.elements[i];
+                for (uint32_t j = incomingStart[q]; j < incomingStart[q + 1]; j++)
+                {
+                    cords.mark(incoming[j]);
+                }
             }
+            cords.split();
+            b++;
         }
     }
 
-    this->initialState = dFSA.initialState;
-    this->states = dFSA.states;
-    this->finalStates = dFSA.finalStates;
-    this->transitions = dFSA.transitions;
-
-    auto timeEnd = std::chrono::high_resolution_clock::now();
-    std::cerr << "det took: " << timeEnd.time_since_epoch().count() - timeStart.time_since_epoch().count() << " nanoseconds\n";
-    std::cerr << "states count:" << states.size() << '\n';
-    std::cerr << "transitions count:" << transitions_count << '\n';
+    return std::move(blocks.setOf);
 }
-/*
-void FSA::minimize()
-{
-    auto timeStart = std::chrono::high_resolution_clock::now();
 
-    std::unordered_set<size_t> nonFinalStates;
-    std::set_difference(states.begin(), states.end(), finalStates.begin(), finalStates.end(),
-                        std::inserter(nonFinalStates, nonFinalStates.begin()));
-
-    // Initial partitions
-    std::vector<std::unordered_set<size_t>> partitions = {finalStates, nonFinalStates};
+// Moore refinement: every round splits the blocks by the signature of their states, the block of
+// the state together with its labels and the blocks of their targets. A round hashes the
+// signatures, sorts the states by hash and numbers the runs of equal signatures, each step split
+// over the same worker threads, so the numbering does not depend on the threads. Rounds are cheap
+// but a DFA can need up to n of them, as a chain of states does. When bounded, the refinement stops
+// after a round that adds fewer than a PARALLEL_MINIMIZE_GROWTH-th of the blocks it had, which
+// leaves O(log n) rounds. Refines block, initially the accept classes, and returns whether it is
+// stable; an unstable block is still a partition that the minimal DFA refines.
+bool FSA::mooreRefinement(std::vector<uint32_t> &block, const std::vector<uint32_t> &tails,
+                          const std::vector<unsigned char> &labels, const std::vector<uint32_t> &heads, size_t threads,
+                          bool bounded)
+{
+    uint32_t n = static_cast<uint32_t>(block.size());
+    uint32_t m = static_cast<uint32_t>(tails.size());
+    if (n == 0)
+    {
+        return true;
+    }
+    WorkerGroup group(threads);
+    size_t parts = group.size();
+    size_t chunk = (n + parts - 1) / parts;
 
-    // The list of partitions to be checked
-    std::list<std::unordered_set<size_t>> toCheck(partitions.begin(), partitions.end());
+    // outgoing transitions of every state, sorted by label
+    std::vector<uint32_t> outStart(n + 1, 0);
+    for (uint32_t tail : tails)
+    {
+        outStart[tail + 1]++;
+    }
+    for (uint32_t q = 0; q < n; q++)
+    {
+        outStart[q + 1] += outStart[q];
+    }
+    std::vector<std::pair<unsigned char, uint32_t>> out(m);
+    std::vector<uint32_t> fill(outStart.begin(), outStart.end() - 1);
+    for (uint32_t t = 0; t < m; t++)
+    {
+        out[fill[tails[t]]++] = {labels[t], heads[t]};
+    }
+    group.run(n, [&](size_t q)
+              { std::sort(out.begin() + outStart[q], out.begin() + outStart[q + 1]); });
 
-    while (!toCheck.empty())
+    // the accept classes are renumbered without the ones no state has
+    std::vector<uint32_t> rank(*std::max_element(block.begin(), block.end()) + 2, 0);
+    for (uint32_t q = 0; q < n; q++)
+    {
+        rank[block[q] + 1] = 1;
+    }
+    for (size_t c = 1; c < rank.size(); c++)
+    {
+        rank[c] += rank[c - 1];
+    }
+    for (uint32_t q = 0; q < n; q++)
     {
-        // Pick and remove a partition from the list
-        std::unordered_set<size_t> partition = toCheck.front();
-        toCheck.pop_front();
+        block[q] = rank[block[q]];
+    }
+    size_t blocks = rank.back();
 
-        // Iterate over the set of input symbols
-        for (char symbol = 'a'; symbol <= 'z'; ++symbol)
+    // orders signatures lexicographically, 0 when they are equal
+    auto compareSignatures = [&](uint32_t p, uint32_t q)
+    {
+        if (block[p] != block[q])
         {
-            // States that transition to the current partition with the current symbol
-            std::unordered_set<size_t> relatedStates;
-
-            for (const auto &state : partition)
+            return block[p] < block[q] ? -1 : 1;
+        }
+        uint32_t pDegree = outStart[p + 1] - outStart[p], qDegree = outStart[q + 1] - outStart[q];
+        if (pDegree != qDegree)
+        {
+            return pDegree < qDegree ? -1 : 1;
+        }
+        for (uint32_t i = outStart[p], j = outStart[q]; i < outStart[p + 1]; i++, j++)
+        {
+            std::pair<unsigned char, uint32_t> a{out[i].first, block[out[i].second]}, b{out[j].first, block[out[j].second]};
+            if (a != b)
             {
-                for (const auto &transition : transitions[state][symbol])
-                {
-                    relatedStates.insert(transition);
-                }
+                return a < b ? -1 : 1;
             }
+        }
+        return 0;
+    };
+
+    // (hash of the signature, state), and whether each position of it starts a new block
+    std::vector<std::pair<uint64_t, uint32_t>> sorted(n);
+    std::vector<uint8_t> starts(n);
+    std::vector<uint32_t> next(n);
+    std::vector<size_t> firstBlock(parts + 1);
+    while (true)
+    {
+        group.run(n, [&](size_t q)
+                  {
+                      uint64_t h = 0x9E3779B97F4A7C15ull ^ block[q];
+                      for (uint32_t i = outStart[q]; i < outStart[q + 1]; i++)
+                      {
+                          h = (h ^ (static_cast<uint64_t>(out[i].first) << 32 | block[out[i].second])) * 0xFF51AFD7ED558CCDull;
+                          h ^= h >> 32;
+                      }
+                      sorted[q] = {h, static_cast<uint32_t>(q)}; });
+        group.run(parts, [&](size_t p)
+                  { std::sort(sorted.begin() + std::min<size_t>(n, p * chunk), sorted.begin() + std::min<size_t>(n, (p + 1) * chunk)); });
+        for (size_t width = chunk; width < n; width *= 2)
+        {
+            group.run((n + 2 * width - 1) / (2 * width), [&](size_t p)
+                      {
+                          size_t begin = p * 2 * width;
+                          std::inplace_merge(sorted.begin() + begin, sorted.begin() + std::min<size_t>(n, begin + width),
+                                             sorted.begin() + std::min<size_t>(n, begin + 2 * width)); });
+        }
 
-            // Iterate over all partitions
-            for (auto it = partitions.begin(); it != partitions.end();)
+        std::atomic<bool> collision{false};
+        group.run(n, [&](size_t i)
+                  {
+                      starts[i] = i == 0 || sorted[i].first != sorted[i - 1].first;
+                      if (!starts[i] && compareSignatures(sorted[i - 1].second, sorted[i].second) != 0)
+                      {
+                          collision = true;
+                      } });
+        if (collision)
+        {
+            // the hashes of different signatures collided: those runs are ordered by the signatures
+            for (size_t first = 0, past; first < n; first = past)
             {
-                // Split partitions in two: states that transition to the current partition and those that don't
-                std::unordered_set<size_t> intersection, difference;
-                std::set_intersection(it->begin(), it->end(), relatedStates.begin(), relatedStates.end(),
-                                      std::inserter(intersection, intersection.begin()));
-                std::set_difference(it->begin(), it->end(), relatedStates.begin(), relatedStates.end(),
-                                    std::inserter(difference, difference.begin()));
-
-                // If one of the sets is empty, don't split the partition
-                if (intersection.empty() || difference.empty())
-                {
-                    ++it;
-                    continue;
-                }
-
-                // Replace the original partition with the intersection and add the difference as a new partition
-                *it = intersection;
-                it = partitions.insert(it, difference);
-
-                // If the original partition is in the list to be checked, replace it with the intersection
-                if (std::find(toCheck.begin(), toCheck.end(), *it) != toCheck.end())
+                for (past = first + 1; past < n && !starts[past]; past++)
                 {
-                    toCheck.remove(*it);
-                    toCheck.push_back(*it);
-                    toCheck.push_back(intersection);
                 }
-                // Otherwise, add the smaller partition to the list to be checked
-                else
+                std::sort(sorted.begin() + first, sorted.begin() + past, [&](const auto &a, const auto &b)
+                          {
+                              int order = compareSignatures(a.second, b.second);
+                              return order != 0 ? order < 0 : a.second < b.second; });
+                for (size_t i = first + 1; i < past; i++)
                 {
-                    if (intersection.size() <= difference.size())
-                    {
-                        toCheck.push_back(intersection);
-                    }
-                    else
-                    {
-                        toCheck.push_back(difference);
-                    }
+                    starts[i] = compareSignatures(sorted[i - 1].second, sorted[i].second) != 0;
                 }
             }
         }
-    }
-
-    std::unordered_set<size_t> newStates;
-    std::unordered_map<std::unordered_set<size_t> *, size_t> partitionIndices;
-    size_t index = 0;
-    for (auto &partition : partitions)
-    {
-        newStates.insert(index);
-        partitionIndices[&partition] = index++;
-    }
-
-    std::unordered_map<size_t, std::unordered_map<char, std::unordered_set<size_t>>> newTransitions;
-    std::unordered_set<size_t> newFinalStates;
-
-    for (auto &partition : partitions)
-    {
-        size_t partitionIndex = partitionIndices[&partition];
 
-        // Update final states
-        std::unordered_set<size_t> intersection;
-        std::set_intersection(partition.begin(), partition.end(), finalStates.begin(), finalStates.end(),
-                              std::inserter(intersection, intersection.begin()));
-        if (!intersection.empty())
+        // blocks are numbered in sorted order: every chunk counts its starts, then numbers its states
+        group.run(parts, [&](size_t p)
+                  { firstBlock[p + 1] = std::count(starts.begin() + std::min<size_t>(n, p * chunk),
+                                                   starts.begin() + std::min<size_t>(n, (p + 1) * chunk), 1); });
+        for (size_t p = 0; p < parts; p++)
         {
-            newFinalStates.insert(partitionIndex);
+            firstBlock[p + 1] += firstBlock[p];
         }
-
-        // Update transitions
-        size_t representativeState = *partition.begin(); // choose a representative state from each partition
-        for (const auto &transition : transitions[representativeState])
+        group.run(parts, [&](size_t p)
+                  {
+                      size_t b = firstBlock[p];
+                      for (size_t i = p * chunk; i < std::min<size_t>(n, (p + 1) * chunk); i++)
+                      {
+                          b += starts[i];
+                          next[sorted[i].second] = static_cast<uint32_t>(b - 1);
+                      } });
+
+        FSA_METRIC_ADD(refinementSplits, firstBlock[parts] - blocks);
+        block.swap(next);
+        if (firstBlock[parts] == blocks)
         {
-            char symbol = transition.first;
-            size_t destinationState = *transition.second.begin(); // assuming there is only one transition for each pair of state and symbol
-
-            // Find the partition of the destination state
-            auto destinationPartition = std::find_if(partitions.begin(), partitions.end(),
-                                                     [destinationState](const auto &partition)
-                                                     {
-                                                         return partition.find(destinationState) != partition.end();
-                                                     });
-            if (destinationPartition != partitions.end())
-            {
-                size_t destinationPartitionIndex = partitionIndices[&*destinationPartition];
-                newTransitions[partitionIndex][symbol] = {destinationPartitionIndex};
-            }
+            return true;
+        }
+        if (bounded && (firstBlock[parts] - blocks) * PARALLEL_MINIMIZE_GROWTH < blocks)
+        {
+            return false;
         }
+        blocks = firstBlock[parts];
     }
-
-    // Update the DFA
-
-    this->states = newStates;
-    this->finalStates = newFinalStates;
-    this->transitions = newTransitions;
-
-    // this->initialState = newInitialState;
-    // this->states = newStates;
-    // this->finalStates = newFinalStates;
-    // this->transitions = newTransitions;
-
-    auto timeEnd = std::chrono::high_resolution_clock::now();
-    std::cerr << "minimize took: " << timeEnd.time_since_epoch().count() - timeStart.time_since_epoch().count() << " nanoseconds\n";
 }
 
-*/
-
-/*
-void FSA::minimize()
+// The parts are numbered 0 .. k - 1 and become the new states; the transitions of each part are
+// those of one representative state.
+void FSA::mergeStates(std::unordered_map<size_t, size_t> &partition)
 {
-    auto timeStart = std::chrono::high_resolution_clock::now();
+    std::unordered_map<size_t, size_t> representative;
+    StateSet newFinalStates(resource());
+    TagMap newTags(resource());
+    TransitionMap newTransitions(resource());
 
-    std::unordered_map<size_t, std::unordered_map<char, std::unordered_set<size_t>>> inverseTransitions;
-    for ( const auto &[fromState, symbolToStates] : transitions )
+    for (const auto &[state, part] : partition)
     {
-        for ( const auto &[symbol, toStates] : symbolToStates )
+        representative.emplace(part, state);
+        if (finalStates.find(state) != finalStates.end())
         {
-            for ( const auto &toState : toStates)
+            newFinalStates.insert(part);
+            auto tags = acceptTags.find(state);
+            if (tags != acceptTags.end())
             {
-                inverseTransitions[toState][symbol].insert(fromState);
+                newTags[part] = tags->second;
             }
         }
     }
 
-    std::unordered_map<size_t, size_t> partition;
-
-    std::vector<std::unordered_set<size_t>> P(states.size());
-
-    for (auto &state : states)
+    size_t newTransitionCount = 0;
+    for (const auto &[part, state] : representative)
     {
-        if (finalStates.count(state) > 0)
+        auto it = transitions.find(state);
+        if (it == transitions.end())
         {
-            P[0].insert(state);
-            partition[state] = 0;
-        }
-        else
-        {
-            P[1].insert(state);
-            partition[state] = 1;
+            continue;
         }
-    }
-
-    std::vector<std::unordered_set<size_t>> W = {P[0], P[1]};
-
-    while (!W.empty())
-    {
-        std::unordered_set<size_t> A = W.back();
-        W.pop_back();
-
-        for (char a = 'a'; a <= 'z'; a++)
+        for (const auto &[a, dest] : it->second)
         {
-            std::unordered_map<size_t, std::unordered_set<size_t>> connected;
-            for (auto q : A)
-            {
-                for (auto state : states)
-                {
-                    if (transitions[state][a].count(q))
-                    {
-                        connected[partition[state]].insert(state);
-                    }
-                }
-            }
-
-            for (auto &[r, statesConnected] : connected)
+            for (const auto &toState : dest)
             {
-                if (statesConnected.size() < P[r].size())
+                auto target = partition.find(toState);
+                if (target != partition.end())
                 {
-                    size_t j = P.size();
-                    P.push_back({});
-                    for (auto state : statesConnected)
-                    {
-                        P[r].erase(state);
-                        P[j].insert(state);
-                        partition[state] = j;
-                    }
-
-                    auto it = std::find(W.begin(), W.end(), P[r]);
-                    if (it != W.end())
-                    {
-                        W.push_back(P[j]);
-                    }
-                    else
-                    {
-                        if (P[r].size() <= P[j].size())
-                        {
-                            W.push_back(P[r]);
-                        }
-                        else
-                        {
-                            W.push_back(P[j]);
-                        }
-                    }
+                    newTransitionCount += newTransitions[part][a].insert(target->second).second;
                 }
             }
         }
     }
 
-    // Now merge states in the same partition and update the transitions
-    mergeStates(partition);
+    // Update FSA states, finalStates, and transitions
+    states.clear();
+    for (size_t part = 0; part < representative.size(); part++)
+    {
+        states.insert(part);
+    }
+    nextState = representative.size();
 
-    auto timeEnd = std::chrono::high_resolution_clock::now();
-    std::cerr << "minimization took: " << timeEnd.time_since_epoch().count() - timeStart.time_since_epoch().count() << " nanoseconds\n";
+    finalStates = std::move(newFinalStates);
+    acceptTags = std::move(newTags);
+    transitions = std::move(newTransitions);
+    numberOfTransitions = newTransitionCount;
+    initialState = partition[initialState];
 }
-*/
 
-void FSA::minimize()
+ByteClasses FSA::symbolClasses() const
 {
-    std::unordered_map<size_t, std::unordered_map<char, std::unordered_set<size_t>>> inverseTransitions;
+    // the signature of a label is the sorted list of the transitions it appears on
+    std::array<std::vector<std::pair<size_t, size_t>>, 256> signatures;
     for (const auto &[fromState, symbolToStates] : transitions)
     {
         for (const auto &[symbol, toStates] : symbolToStates)
         {
+            if (symbol == EPSILON)
+            {
+                continue;
+            }
             for (const auto &toState : toStates)
             {
-                inverseTransitions[toState][symbol].insert(fromState);
+                signatures[static_cast<unsigned char>(symbol)].emplace_back(fromState, toState);
             }
         }
     }
+    for (auto &signature : signatures)
+    {
+        std::sort(signature.begin(), signature.end());
+    }
 
-    std::unordered_map<size_t, size_t> partition;
-    std::vector<std::unordered_set<size_t>> P(states.size());
-
-    for (auto &state : states)
+    // bytes are visited in increasing order, so EPSILON (with an empty signature) opens class 0
+    ByteClasses classes;
+    classes.representatives.clear();
+    std::map<std::vector<std::pair<size_t, size_t>>, uint8_t> classOfSignature;
+    for (size_t byte = 0; byte < 256; byte++)
     {
-        if (finalStates.count(state) > 0)
-        {
-            P[0].insert(state);
-            partition[state] = 0;
-        }
-        else
+        const auto &signature = signatures[alphabet.representative(static_cast<unsigned char>(byte))];
+        auto [match, inserted] = classOfSignature.try_emplace(signature, static_cast<uint8_t>(classes.representatives.size()));
+        if (inserted)
         {
-            P[1].insert(state);
-            partition[state] = 1;
+            classes.representatives.push_back(static_cast<unsigned char>(byte));
         }
+        classes.classOf[byte] = match->second;
     }
+    return classes;
+}
 
-    std::vector<std::unordered_set<size_t>> W = {P[0], P[1]};
+void FSA::compressAlphabet()
+{
+    FSA_METRIC_PHASE(COMPRESS);
+    alphabet = symbolClasses();
 
-    while (!W.empty())
+    TransitionMap newTransitions(resource());
+    for (auto &[fromState, symbolToStates] : transitions)
     {
-        std::unordered_set<size_t> A = W.back();
-        W.pop_back();
-
-        for (char a = 'a'; a <= 'z'; a++)
+        auto &newSymbolToStates = newTransitions[fromState];
+        for (auto &[symbol, toStates] : symbolToStates)
         {
-            std::unordered_map<size_t, std::unordered_set<size_t>> connected;
-
-            for (auto q : A)
+            char label = static_cast<char>(alphabet.representative(static_cast<unsigned char>(symbol)));
+            if (newSymbolToStates.count(label) == 0)
             {
-                // Use the inverse transition function to improve efficiency
-                if (inverseTransitions[q].count(a))
-                {
-                    for (auto state : inverseTransitions[q][a])
-                    {
-                        connected[partition[state]].insert(state);
-                    }
-                }
+                newSymbolToStates[label] = std::move(toStates);
             }
-
-            for (auto &[r, statesConnected] : connected)
+            else
             {
-                if (statesConnected.size() < P[r].size())
-                {
-                    size_t j = P.size();
-                    P.push_back({});
-                    for (auto state : statesConnected)
-                    {
-                        P[r].erase(state);
-                        P[j].insert(state);
-                        partition[state] = j;
-                    }
-
-                    auto it = std::find(W.begin(), W.end(), P[r]);
-                    if (it != W.end())
-                    {
-                        W.push_back(P[j]);
-                    }
-                    else
-                    {
-                        if (P[r].size() <= P[j].size())
-                        {
-                            W.push_back(P[r]);
-                        }
-                        else
-                        {
-                            W.push_back(P[j]);
-                        }
-                    }
-                }
+                // a label of the same class has the same targets
+                numberOfTransitions -= toStates.size();
             }
         }
     }
-
-    // Now merge states in the same partition and update the transitions
-    mergeStates(partition);
+    transitions = std::move(newTransitions);
 }
 
-void FSA::mergeStates(std::unordered_map<size_t, size_t> &partition)
+void FSA::expandAlphabet()
 {
-    std::unordered_map<size_t, size_t> representative;
-    std::unordered_set<size_t> newFinalStates;
-    std::unordered_map<size_t, std::unordered_map<char, std::unordered_set<size_t>>> newTransitions;
-
-    for (const auto &[state, part] : partition)
+    if (alphabet.size() == 256)
     {
-        if (representative.find(part) == representative.end())
-        {
-            representative[part] = state;
-        }
-        if (finalStates.find(state) != finalStates.end())
-        {
-            newFinalStates.insert(representative[part]);
-        }
+        return;
     }
-
-    for (const auto &[state, part] : partition)
+    TransitionMap newTransitions(resource());
+    for (auto &[fromState, symbolToStates] : transitions)
     {
-        for (const auto &[a, dest] : transitions[state])
+        auto &newSymbolToStates = newTransitions[fromState];
+        for (auto &[symbol, toStates] : symbolToStates)
         {
-            for (const auto &toState : dest)
+            if (symbol == EPSILON)
+            {
+                newSymbolToStates[EPSILON] = std::move(toStates);
+                continue;
+            }
+            uint8_t cls = alphabet.classOf[static_cast<unsigned char>(symbol)];
+            numberOfTransitions -= toStates.size();
+            for (size_t byte = 1; byte < 256; byte++)
             {
-                newTransitions[representative[part]][a].insert(representative[partition[toState]]);
+                if (alphabet.classOf[byte] == cls)
+                {
+                    newSymbolToStates[static_cast<char>(byte)].insert(toStates.begin(), toStates.end());
+                    numberOfTransitions += toStates.size();
+                }
             }
         }
     }
-
-    // Update FSA states, finalStates, and transitions
-    states.clear();
-    for (const auto &[_, state] : representative)
-    {
-        states.insert(state);
-    }
-
-    finalStates = newFinalStates;
-    transitions = newTransitions;
-    initialState = representative[partition[initialState]];
-}
\ No newline at end of file
+    transitions = std::move(newTransitions);
+    alphabet = ByteClasses();
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FSA.cpp"
+
+// Determinizes an NFA on demand while matching. A subset state and its transitions are only
+// computed when the input reaches them, and they are kept in a cache of at most maxStates
+// states. When the cache is full it is flushed and rebuilt from the state being left, so
+// memory stays bounded whatever the size of the full powerset.
+//
+// A complemented LazyDFA accepts exactly what the NFA rejects: every cached subset, the empty one
+// included, has its acceptance flipped, so a complement at the top of an expression costs nothing.
+class LazyDFA
+{
+private:
+    static constexpr uint32_t UNKNOWN = UINT32_MAX;
+    static constexpr uint32_t DEAD = UINT32_MAX - 1;
+
+    DenseNFA nfa;
+    ByteClasses classes;
+    size_t maxStates;
+    bool sinkFinal;
+    bool complemented;
+
+    StateSetArena subsets;
+    std::vector<uint32_t> next;
+    std::vector<bool> finalStates;
+    std::vector<uint32_t> startSet;
+    uint32_t startState;
+
+    std::vector<uint32_t> stamp;
+    uint32_t epoch;
+    std::vector<uint32_t> newState;
+    size_t flushCount;
+
+    uint32_t addState(const std::vector<uint32_t> &subset);
+    void flush();
+    uint32_t computeNext(uint32_t &state, uint8_t cls);
+
+public:
+    explicit LazyDFA(const FSA &nfa, size_t maxStates = 10000, bool complemented = false);
+
+    // Builds the automaton of expression with FSA::Construction::Lazy. The complements at its top
+    // are taken by flipping acceptance; the ones below still determinize their operand.
+    static LazyDFA parse(const std::string &expression, FSA::Engine engine = FSA::Engine::Thompson,
+                         size_t maxStates = 10000);
+
+    bool matches(const char *data, size_t length);
+    bool matches(const std::string &word) { return matches(word.data(), word.size()); }
+
+    size_t cachedStates() const { return subsets.size(); }
+    size_t flushes() const { return flushCount; }
+};
+
+LazyDFA::LazyDFA(const FSA &automaton, size_t maxStates, bool complemented)
+    : nfa(automaton.toDenseNFA()), classes(automaton.symbolClasses()), maxStates(std::max<size_t>(maxStates, 2)),
+      sinkFinal(automaton.sinkFinal != complemented), complemented(complemented),
+      stamp(nfa.size(), 0), epoch(0), flushCount(0)
+{
+    startSet.assign(1, nfa.initialState);
+    startState = addState(startSet);
+}
+
+LazyDFA LazyDFA::parse(const std::string &expression, FSA::Engine engine, size_t maxStates)
+{
+    RegexAST ast = RegexAST::parse(expression);
+    bool complemented = false;
+    for (; ast.nodes[ast.root].op == '~'; ast.root = ast.nodes[ast.root].left)
+    {
+        complemented = !complemented;
+    }
+    std::unique_ptr<FSA> automaton(FSA::fromAST(ast, engine, FSA::Construction::Lazy));
+    return LazyDFA(*automaton, maxStates, complemented);
+}
+
+uint32_t LazyDFA::addState(const std::vector<uint32_t> &subset)
+{
+    auto [id, inserted] = subsets.intern(subset);
+    FSA_METRIC_ADD(subsetLookups, 1);
+    FSA_METRIC_ADD(subsetHits, !inserted);
+    if (inserted)
+    {
+        next.resize(subsets.size() * classes.size(), UNKNOWN);
+        finalStates.push_back(complemented != std::any_of(subset.begin(), subset.end(), [this](uint32_t q)
+                                                          { return nfa.finalStates[q]; }));
+    }
+    return id;
+}
+
+void LazyDFA::flush()
+{
+    subsets.clear();
+    next.clear();
+    finalStates.clear();
+    flushCount++;
+    startState = addState(startSet);
+}
+
+uint32_t LazyDFA::computeNext(uint32_t &state, uint8_t cls)
+{
+    char symbol = static_cast<char>(classes.representatives[cls]);
+
+    // the targets of every move on the class representative
+    epoch++;
+    newState.clear();
+    for (const uint32_t *member = subsets.begin(state); member != subsets.end(state); ++member)
+    {
+        auto first = nfa.moveSymbols.begin() + nfa.moveStart[*member];
+        auto last = nfa.moveSymbols.begin() + nfa.moveStart[*member + 1];
+        for (auto move = std::lower_bound(first, last, symbol); move != last && *move == symbol; ++move)
+        {
+            uint32_t target = nfa.moveTargets[move - nfa.moveSymbols.begin()];
+            if (stamp[target] != epoch)
+            {
+                stamp[target] = epoch;
+                newState.push_back(target);
+            }
+        }
+    }
+
+    if (newState.empty())
+    {
+        next[static_cast<size_t>(state) * classes.size() + cls] = DEAD;
+        return DEAD;
+    }
+    std::sort(newState.begin(), newState.end());
+
+    if (subsets.size() >= maxStates)
+    {
+        std::vector<uint32_t> current(subsets.begin(state), subsets.end(state));
+        flush();
+        state = addState(current);
+    }
+
+    uint32_t target = addState(newState);
+    next[static_cast<size_t>(state) * classes.size() + cls] = target;
+    return target;
+}
+
+bool LazyDFA::matches(const char *data, size_t length)
+{
+    const unsigned char *byte = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = byte + length;
+
+    uint32_t state = startState;
+    for (; byte != end; ++byte)
+    {
+        uint8_t cls = classes.classOf[*byte];
+        uint32_t target = next[static_cast<size_t>(state) * classes.size() + cls];
+        if (target == UNKNOWN)
+        {
+            target = computeNext(state, cls);
+        }
+        if (target == DEAD)
+        {
+            // the empty subset is the implicit sink
+            return sinkFinal;
+        }
+        state = target;
+    }
+    return finalStates[state];
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "DenseDFA.cpp"
+
+// Layout of a compiled DFA file. The header is followed by the byte classes, the final bitmap,
+// the transition table and free-form metadata (the source expression, say), each starting at a
+// 64-byte boundary so that a mapping of the file can be used as a DFAView directly. The checksum
+// covers the whole file, the header included with its checksum field taken as zero.
+struct DFAFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t stateCount;
+    uint32_t columns;
+    uint32_t initial;
+    uint32_t reserved;
+    uint64_t classOffset;
+    uint64_t finalOffset;
+    uint64_t nextOffset;
+    uint64_t metadataOffset;
+    uint64_t metadataSize;
+    uint64_t fileSize;
+    uint64_t checksum;
+};
+
+// A compiled DFA loaded with mmap. Nothing is deserialized: the view points into the mapping,
+// so processes that load the same file share its pages.
+class MappedDFA
+{
+private:
+    void *data;
+    size_t length;
+    const DFAFileHeader *header;
+
+    static constexpr char MAGIC[8] = {'F', 'S', 'A', 'D', 'F', 'A', '\r', '\n'};
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+    static constexpr size_t ALIGNMENT = 64;
+
+    static uint64_t align(uint64_t offset) { return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+    static uint64_t checksum(DFAFileHeader header, const unsigned char *bytes, size_t length);
+
+    void validate(bool verify) const;
+
+public:
+    static constexpr uint32_t VERSION = 2;
+
+    // with verify the checksum and every table entry are checked, otherwise only the header
+    explicit MappedDFA(const std::string &path, bool verify = true);
+    MappedDFA(const MappedDFA &) = delete;
+    MappedDFA &operator=(const MappedDFA &) = delete;
+    ~MappedDFA();
+
+    DFAView view() const;
+    std::string metadata() const;
+
+    static void save(const DFAView &dfa, const std::string &path, const std::string &metadata = "");
+};
+
+// word-wise multiply-xor hash over a file of the given length; the header is hashed from the copy
+// with its checksum cleared, then the bytes that follow it. The sections are padded to 8 bytes with zeros
+uint64_t MappedDFA::checksum(DFAFileHeader header, const unsigned char *bytes, size_t length)
+{
+    static_assert(sizeof(DFAFileHeader) % 8 == 0, "the header must be a whole number of words");
+    header.checksum = 0;
+    const unsigned char *head = reinterpret_cast<const unsigned char *>(&header);
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ length;
+    for (size_t i = 0; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, i < sizeof(DFAFileHeader) ? head + i : bytes + i, 8);
+        h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    return h ^ (h >> 32);
+}
+
+void MappedDFA::save(const DFAView &dfa, const std::string &path, const std::string &metadata)
+{
+    if (dfa.acceptStart != nullptr)
+    {
+        throw std::runtime_error("Multi-pattern DFAs cannot be saved");
+    }
+    size_t finalWords = (static_cast<size_t>(dfa.stateCount) + 63) / 64;
+    size_t cells = static_cast<size_t>(dfa.stateCount) * dfa.columns;
+
+    DFAFileHeader header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.stateCount = dfa.stateCount;
+    header.columns = dfa.columns;
+    header.initial = dfa.initial;
+    header.classOffset = align(sizeof(DFAFileHeader));
+    header.finalOffset = align(header.classOffset + 256);
+    header.nextOffset = align(header.finalOffset + finalWords * sizeof(uint64_t));
+    header.metadataOffset = align(header.nextOffset + cells * sizeof(uint32_t));
+    header.metadataSize = metadata.size();
+    header.fileSize = align(header.metadataOffset + metadata.size());
+
+    std::string image(header.fileSize, '\0');
+    std::memcpy(&image[header.classOffset], dfa.byteClass, 256);
+    std::memcpy(&image[header.finalOffset], dfa.finalBits, finalWords * sizeof(uint64_t));
+    std::memcpy(&image[header.nextOffset], dfa.next, cells * sizeof(uint32_t));
+    std::memcpy(&image[header.metadataOffset], metadata.data(), metadata.size());
+    header.checksum = checksum(header, reinterpret_cast<const unsigned char *>(image.data()), image.size());
+    std::memcpy(&image[0], &header, sizeof(DFAFileHeader));
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+    if (!out)
+    {
+        throw std::runtime_error("Cannot write file: " + path);
+    }
+}
+
+MappedDFA::MappedDFA(const std::string &path, bool verify) : data(MAP_FAILED), length(0), header(nullptr)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(DFAFileHeader))
+    {
+        close(fd);
+        throw std::runtime_error("Not a compiled DFA: " + path);
+    }
+
+    length = static_cast<size_t>(info.st_size);
+    data = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        throw std::runtime_error("Cannot map file: " + path);
+    }
+    header = static_cast<const DFAFileHeader *>(data);
+
+    try
+    {
+        validate(verify);
+    }
+    catch (const std::runtime_error &error)
+    {
+        munmap(data, length);
+        throw std::runtime_error(std::string(error.what()) + ": " + path);
+    }
+}
+
+MappedDFA::~MappedDFA()
+{
+    munmap(data, length);
+}
+
+void MappedDFA::validate(bool verify) const
+{
+    if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        throw std::runtime_error("Not a compiled DFA");
+    }
+    if (header->version != VERSION)
+    {
+        throw std::runtime_error("Unsupported DFA version " + std::to_string(header->version));
+    }
+    if (header->byteOrder != BYTE_ORDER_MARK)
+    {
+        throw std::runtime_error("DFA written with a different byte order");
+    }
+
+    uint64_t finalWords = (static_cast<uint64_t>(header->stateCount) + 63) / 64;
+    uint64_t cells = static_cast<uint64_t>(header->stateCount) * header->columns;
+    // every offset is bounded by the length first, so the sums below cannot overflow
+    bool consistent = header->fileSize == length && header->classOffset <= length && header->finalOffset <= length &&
+                      header->nextOffset <= length && header->metadataOffset <= length && header->metadataSize <= length &&
+                      header->stateCount > header->initial &&
+                      header->columns >= 1 && header->columns <= 256 &&
+                      header->classOffset >= sizeof(DFAFileHeader) && header->classOffset + 256 <= header->finalOffset &&
+                      header->finalOffset + finalWords * sizeof(uint64_t) <= header->nextOffset &&
+                      header->nextOffset + cells * sizeof(uint32_t) <= header->metadataOffset &&
+                      header->metadataOffset + header->metadataSize <= length &&
+                      header->classOffset % ALIGNMENT == 0 && header->finalOffset % ALIGNMENT == 0 &&
+                      header->nextOffset % ALIGNMENT == 0;
+    if (!consistent)
+    {
+        throw std::runtime_error("Corrupt DFA header");
+    }
+    if (!verify)
+    {
+        return;
+    }
+
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    if (checksum(*header, bytes, length) != header->checksum)
+    {
+        throw std::runtime_error("DFA checksum mismatch");
+    }
+
+    // a table that passes these checks cannot lead the matcher outside the mapping
+    DFAView dfa = view();
+    for (size_t byte = 0; byte < 256; byte++)
+    {
+        if (dfa.byteClass[byte] >= dfa.columns)
+        {
+            throw std::runtime_error("Corrupt DFA byte classes");
+        }
+    }
+    for (uint64_t cell = 0; cell < cells; cell++)
+    {
+        if (dfa.next[cell] >= dfa.stateCount)
+        {
+            throw std::runtime_error("Corrupt DFA transition table");
+        }
+    }
+}
+
+DFAView MappedDFA::view() const
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    return {reinterpret_cast<const uint32_t *>(bytes + header->nextOffset),
+            reinterpret_cast<const uint64_t *>(bytes + header->finalOffset),
+            reinterpret_cast<const uint8_t *>(bytes + header->classOffset),
+            header->columns, header->stateCount, header->initial};
+}
+
+std::string MappedDFA::metadata() const
+{
+    return std::string(static_cast<const char *>(data) + header->metadataOffset, header->metadataSize);
+}
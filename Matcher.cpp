@@ -0,0 +1,520 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <istream>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "DenseDFA.cpp"
+
+// Runs a compiled DFA over strings, buffers, streams and memory-mapped files. A line matches when
+// the automaton accepts the whole line without its '\n'. The inner loop stops as soon as the
+// automaton reaches the dead state or the accepting sink, the state that accepts every suffix.
+class Matcher
+{
+private:
+    DFAView dfa;
+    uint32_t acceptSink;
+
+    static constexpr size_t BLOCK_SIZE = 1 << 20;
+    // strings advanced together by matchBatch, for tables larger than BATCH_TABLE_BYTES
+    static constexpr size_t BATCH_LANES = 16;
+    static constexpr size_t BATCH_TABLE_BYTES = 1 << 20;
+    // matchesParallel gives each thread at least this many bytes
+    static constexpr size_t MIN_CHUNK = 1 << 16;
+    // a chunk runs its possible start states together until at most this many remain
+    static constexpr size_t SPECULATION_LIMIT = 8;
+    static constexpr size_t MERGE_INTERVAL = 64;
+
+    // The states a chunk leads to: start state q ends in active[slot[origin[q]]]. States that reach
+    // the dead state or the accepting sink leave active and store ABSORBED | state in their place.
+    struct Speculation
+    {
+        static constexpr uint32_t ABSORBED = 1u << 31;
+
+        std::vector<uint32_t> origin;
+        std::vector<uint32_t> slot;
+        std::vector<uint32_t> active;
+        bool resolved = false;
+
+        uint32_t resolve(uint32_t state) const
+        {
+            uint32_t index = origin[state];
+            if (!(index & ABSORBED))
+            {
+                index = slot[index];
+            }
+            return index & ABSORBED ? index & ~ABSORBED : active[index];
+        }
+    };
+
+    uint32_t run(uint32_t state, const char *data, size_t length) const;
+    void speculate(const char *data, size_t length, Speculation &chunk) const;
+
+    template <typename Body>
+    static auto withMappedFile(const std::string &path, Body &&body);
+
+public:
+    static constexpr uint32_t NO_STATE = UINT32_MAX;
+
+    explicit Matcher(const DFAView &dfa);
+    explicit Matcher(const DenseDFA &dfa) : Matcher(dfa.view()) {}
+
+    bool isFinal(uint32_t state) const
+    {
+        return (dfa.finalBits[state >> 6] >> (state & 63)) & 1;
+    }
+
+    bool matches(const char *data, size_t length) const;
+    bool matches(const std::string &word) const { return matches(word.data(), word.size()); }
+
+    // counts a visit of every state the input passes through into visits[state], growing it to
+    // the number of states, for DenseDFA::reorder
+    void profile(const char *data, size_t length, std::vector<uint64_t> &visits) const;
+
+    // matches one large input split into a chunk per thread, 0 uses every hardware thread
+    bool matchesParallel(const char *data, size_t length, size_t threads = 0) const;
+    bool matchesFile(const std::string &path, size_t threads = 0) const;
+
+    // Matches count strings in one interleaved pass, string i being bytes[offsets[i] .. offsets[i + 1]).
+    // Bit i of the result is set when string i is accepted.
+    std::vector<uint64_t> matchBatch(const char *bytes, const size_t *offsets, size_t count) const;
+
+    // the sorted IDs of the patterns of a multi-pattern DFA that accept the input, found in one pass
+    std::pair<const uint32_t *, const uint32_t *> matchingPatterns(const char *data, size_t length) const;
+    std::pair<const uint32_t *, const uint32_t *> matchingPatterns(const std::string &word) const
+    {
+        return matchingPatterns(word.data(), word.size());
+    }
+
+    template <typename OnMatch>
+    size_t scanLines(const char *data, size_t length, OnMatch &&onMatch) const;
+    template <typename OnMatch>
+    size_t scanLines(std::istream &input, OnMatch &&onMatch) const;
+    template <typename OnMatch>
+    size_t scanFile(const std::string &path, OnMatch &&onMatch) const;
+};
+
+Matcher::Matcher(const DFAView &dfa) : dfa(dfa), acceptSink(NO_STATE)
+{
+    // a minimal DFA has at most one final state whose every transition loops back to itself
+    for (uint32_t state = 1; state < dfa.stateCount && acceptSink == NO_STATE; state++)
+    {
+        if (!isFinal(state))
+        {
+            continue;
+        }
+        const uint32_t *row = dfa.next + static_cast<size_t>(state) * dfa.columns;
+        if (std::all_of(row, row + dfa.columns, [state](uint32_t toState)
+                        { return toState == state; }))
+        {
+            acceptSink = state;
+        }
+    }
+}
+
+// the state the input leads to from state, cut short at the dead state and the accepting sink
+uint32_t Matcher::run(uint32_t state, const char *data, size_t length) const
+{
+    const unsigned char *byte = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = byte + length;
+    const uint32_t *next = dfa.next;
+    const uint8_t *byteClass = dfa.byteClass;
+    const size_t columns = dfa.columns;
+
+    for (; byte != end; ++byte)
+    {
+        state = next[state * columns + byteClass[*byte]];
+        if (state == DenseDFA::DEAD_STATE || state == acceptSink)
+        {
+            return state;
+        }
+    }
+    return state;
+}
+
+bool Matcher::matches(const char *data, size_t length) const
+{
+    return isFinal(run(dfa.initial, data, length));
+}
+
+void Matcher::profile(const char *data, size_t length, std::vector<uint64_t> &visits) const
+{
+    if (visits.size() < dfa.stateCount)
+    {
+        visits.resize(dfa.stateCount, 0);
+    }
+    const unsigned char *byte = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = byte + length;
+    uint32_t state = dfa.initial;
+    visits[state]++;
+    for (; byte != end && state != DenseDFA::DEAD_STATE && state != acceptSink; ++byte)
+    {
+        state = dfa.next[static_cast<size_t>(state) * dfa.columns + dfa.byteClass[*byte]];
+        visits[state]++;
+    }
+}
+
+// Every chunk but the first is run before the state it starts in is known. It starts from every
+// state at once and merges the ones that meet, which on a minimized DFA usually leaves a single
+// state after a few bytes; the chunks are then stitched in order by looking up where each one
+// leads from the state the previous one ended in. A chunk whose states do not merge within the
+// lookups it was allowed is run again once its start state is known.
+bool Matcher::matchesParallel(const char *data, size_t length, size_t threads) const
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t chunks = std::min(threads, length / MIN_CHUNK);
+    if (chunks <= 1)
+    {
+        return matches(data, length);
+    }
+
+    size_t chunkLength = length / chunks;
+    auto chunkEnd = [&](size_t i)
+    { return i + 1 == chunks ? length : (i + 1) * chunkLength; };
+
+    std::vector<Speculation> speculations(chunks);
+    uint32_t state = dfa.initial;
+    parallelFor(chunks, chunks, [&](size_t i)
+                {
+                    if (i == 0)
+                    {
+                        state = run(dfa.initial, data, chunkEnd(0));
+                    }
+                    else
+                    {
+                        speculate(data + i * chunkLength, chunkEnd(i) - i * chunkLength, speculations[i]);
+                    } });
+
+    for (size_t i = 1; i < chunks && state != DenseDFA::DEAD_STATE && state != acceptSink; i++)
+    {
+        state = speculations[i].resolved ? speculations[i].resolve(state)
+                                         : run(state, data + i * chunkLength, chunkEnd(i) - i * chunkLength);
+    }
+    return isFinal(state);
+}
+
+// While more than SPECULATION_LIMIT states remain they are merged after every byte and the start
+// states are renumbered, which costs a pass over all of them; the chunk gives up once that has
+// taken more lookups than a quarter of its length. The few states left are then merged every
+// MERGE_INTERVAL bytes, and a single one runs like any other match. The dead state and the
+// accepting sink never leave themselves, so they are not followed at all.
+void Matcher::speculate(const char *data, size_t length, Speculation &chunk) const
+{
+    const unsigned char *byte = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = byte + length;
+    const uint32_t *next = dfa.next;
+    const uint8_t *byteClass = dfa.byteClass;
+    const size_t columns = dfa.columns;
+    size_t budget = length / 4;
+
+    std::vector<uint32_t> &active = chunk.active;
+    std::vector<uint32_t> indexOf(dfa.stateCount, NO_STATE);
+    std::vector<uint32_t> merged;
+    chunk.origin.resize(dfa.stateCount);
+    for (uint32_t state = 0; state < dfa.stateCount; state++)
+    {
+        chunk.origin[state] = static_cast<uint32_t>(active.size());
+        active.push_back(state);
+    }
+
+    // keeps the first of equal states, merged[i] is the new index of active[i]
+    auto merge = [&](std::vector<uint32_t> &indices)
+    {
+        merged.resize(active.size());
+        uint32_t kept = 0;
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            uint32_t state = active[i];
+            if (state == DenseDFA::DEAD_STATE || state == acceptSink)
+            {
+                merged[i] = Speculation::ABSORBED | state;
+                continue;
+            }
+            uint32_t &index = indexOf[state];
+            if (index == NO_STATE)
+            {
+                index = kept;
+                active[kept++] = state;
+            }
+            merged[i] = index;
+        }
+        active.resize(kept);
+        for (uint32_t state : active)
+        {
+            indexOf[state] = NO_STATE;
+        }
+        for (uint32_t &index : indices)
+        {
+            if (!(index & Speculation::ABSORBED))
+            {
+                index = merged[index];
+            }
+        }
+    };
+    merge(chunk.origin);
+
+    for (; active.size() > SPECULATION_LIMIT && byte != end; ++byte)
+    {
+        size_t work = active.size() + chunk.origin.size();
+        if (work > budget)
+        {
+            return;
+        }
+        budget -= work;
+
+        size_t column = byteClass[*byte];
+        for (uint32_t &state : active)
+        {
+            state = next[state * columns + column];
+        }
+        merge(chunk.origin);
+    }
+
+    chunk.slot.resize(active.size());
+    std::iota(chunk.slot.begin(), chunk.slot.end(), 0);
+    while (active.size() > 1 && byte != end)
+    {
+        const unsigned char *stop = byte + std::min<size_t>(MERGE_INTERVAL, end - byte);
+        for (; byte != stop; ++byte)
+        {
+            size_t column = byteClass[*byte];
+            for (uint32_t &state : active)
+            {
+                state = next[state * columns + column];
+            }
+        }
+        merge(chunk.slot);
+    }
+    if (active.size() == 1 && byte != end)
+    {
+        active[0] = run(active[0], reinterpret_cast<const char *>(byte), end - byte);
+    }
+    chunk.resolved = true;
+}
+
+// The strings are spread over BATCH_LANES lanes that take one step each in turn, so the transition
+// loads of different strings do not depend on each other and their latencies overlap. A sweep
+// steps every lane without branching and collects the lanes whose string ended or reached the dead
+// state or the accepting sink; those are recorded and refilled after it. Lanes left without a
+// string wait on a one-byte string of their own, which ends at every sweep.
+//
+// A table that fits in the L2 cache answers each step quickly enough that the bookkeeping of the
+// lanes costs more than it hides, so such tables are run one string at a time.
+std::vector<uint64_t> Matcher::matchBatch(const char *bytes, const size_t *offsets, size_t count) const
+{
+    static const unsigned char idle = 0;
+    std::vector<uint64_t> accepted((count + 63) / 64, 0);
+    if (static_cast<size_t>(dfa.stateCount) * dfa.columns * sizeof(uint32_t) <= BATCH_TABLE_BYTES)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            accepted[i >> 6] |= static_cast<uint64_t>(matches(bytes + offsets[i], offsets[i + 1] - offsets[i])) << (i & 63);
+        }
+        return accepted;
+    }
+
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(bytes);
+    const uint32_t *next = dfa.next;
+    const uint8_t *byteClass = dfa.byteClass;
+    const size_t columns = dfa.columns;
+
+    std::array<const unsigned char *, BATCH_LANES> cursor, end;
+    std::array<size_t, BATCH_LANES> string;
+    std::array<uint32_t, BATCH_LANES> state;
+    size_t pending = 0, busy = 0;
+
+    // starts the next string in lane, empty strings are decided right away
+    auto refill = [&](size_t lane)
+    {
+        for (; pending < count; pending++)
+        {
+            if (offsets[pending + 1] == offsets[pending])
+            {
+                accepted[pending >> 6] |= static_cast<uint64_t>(isFinal(dfa.initial)) << (pending & 63);
+                continue;
+            }
+            cursor[lane] = data + offsets[pending];
+            end[lane] = data + offsets[pending + 1];
+            string[lane] = pending++;
+            state[lane] = dfa.initial;
+            return true;
+        }
+        cursor[lane] = &idle;
+        end[lane] = &idle + 1;
+        string[lane] = SIZE_MAX;
+        state[lane] = DenseDFA::DEAD_STATE;
+        return false;
+    };
+
+    for (size_t lane = 0; lane < BATCH_LANES; lane++)
+    {
+        busy += refill(lane);
+    }
+    while (busy)
+    {
+        uint32_t finished = 0;
+        for (size_t lane = 0; lane < BATCH_LANES; lane++)
+        {
+            uint32_t target = next[state[lane] * columns + byteClass[*cursor[lane]]];
+            state[lane] = target;
+            bool stop = (++cursor[lane] == end[lane]) | (target == DenseDFA::DEAD_STATE) | (target == acceptSink);
+            finished |= static_cast<uint32_t>(stop) << lane;
+        }
+        for (; finished; finished &= finished - 1)
+        {
+            size_t lane = __builtin_ctz(finished);
+            size_t index = string[lane];
+            if (index != SIZE_MAX)
+            {
+                accepted[index >> 6] |= static_cast<uint64_t>(isFinal(state[lane])) << (index & 63);
+                busy -= !refill(lane);
+            }
+            else
+            {
+                cursor[lane] = &idle;
+            }
+        }
+    }
+    return accepted;
+}
+
+std::pair<const uint32_t *, const uint32_t *> Matcher::matchingPatterns(const char *data, size_t length) const
+{
+    if (dfa.acceptStart == nullptr)
+    {
+        throw std::runtime_error("Matcher requires a multi-pattern DFA");
+    }
+    uint32_t state = run(dfa.initial, data, length);
+    return {dfa.acceptTags + dfa.acceptStart[state], dfa.acceptTags + dfa.acceptStart[state + 1]};
+}
+
+template <typename OnMatch>
+size_t Matcher::scanLines(const char *data, size_t length, OnMatch &&onMatch) const
+{
+    size_t matched = 0;
+    const char *end = data + length;
+    while (data < end)
+    {
+        const char *newline = static_cast<const char *>(std::memchr(data, '\n', end - data));
+        const char *lineEnd = newline ? newline : end;
+        if (matches(data, lineEnd - data))
+        {
+            ++matched;
+            onMatch(data, static_cast<size_t>(lineEnd - data));
+        }
+        data = lineEnd + 1;
+    }
+    return matched;
+}
+
+template <typename OnMatch>
+size_t Matcher::scanLines(std::istream &input, OnMatch &&onMatch) const
+{
+    // complete lines are matched straight from the block; an incomplete last line is moved to
+    // the front of the buffer and finished by the next read
+    std::vector<char> buffer(BLOCK_SIZE);
+    size_t pending = 0;
+    size_t matched = 0;
+
+    while (input)
+    {
+        if (pending == buffer.size())
+        {
+            buffer.resize(buffer.size() * 2);
+        }
+        input.read(buffer.data() + pending, buffer.size() - pending);
+        size_t filled = pending + static_cast<size_t>(input.gcount());
+
+        const char *lastNewline = static_cast<const char *>(memrchr(buffer.data() + pending, '\n', filled - pending));
+        if (lastNewline == nullptr)
+        {
+            pending = filled;
+            continue;
+        }
+
+        size_t complete = lastNewline - buffer.data();
+        matched += scanLines(buffer.data(), complete, onMatch);
+        pending = filled - complete - 1;
+        std::memmove(buffer.data(), lastNewline + 1, pending);
+    }
+
+    if (pending)
+    {
+        matched += scanLines(buffer.data(), pending, onMatch);
+    }
+    return matched;
+}
+
+template <typename OnMatch>
+size_t Matcher::scanFile(const std::string &path, OnMatch &&onMatch) const
+{
+    return withMappedFile(path, [&](const char *data, size_t length)
+                          { return scanLines(data, length, onMatch); });
+}
+
+// maps the file read-only and returns body(data, length), an empty file gives body(nullptr, 0)
+template <typename Body>
+auto Matcher::withMappedFile(const std::string &path, Body &&body)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Cannot stat file: " + path);
+    }
+    if (info.st_size == 0)
+    {
+        close(fd);
+        return body(nullptr, 0);
+    }
+
+    struct Mapping
+    {
+        void *data;
+        size_t length;
+        ~Mapping()
+        {
+            if (data != MAP_FAILED)
+            {
+                munmap(data, length);
+            }
+        }
+    };
+
+    size_t length = static_cast<size_t>(info.st_size);
+    Mapping mapping{mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0), length};
+    close(fd);
+    if (mapping.data == MAP_FAILED)
+    {
+        throw std::runtime_error("Cannot map file: " + path);
+    }
+    madvise(mapping.data, length, MADV_SEQUENTIAL);
+
+    return body(static_cast<const char *>(mapping.data), length);
+}
+
+bool Matcher::matchesFile(const std::string &path, size_t threads) const
+{
+    return withMappedFile(path, [&](const char *data, size_t length)
+                          { return matchesParallel(data, length, threads); });
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include <sys/resource.h>
+
+// Counters of the construction pipeline: wall time per phase, the sizes of the automata each
+// phase produced, subset cache and refinement activity, and the peak resident memory of the
+// process. The library only records through the FSA_METRIC_* macros below, which are empty unless
+// it is built with -DFSA_METRICS, so a normal build pays nothing and reads back zeros.
+struct Metrics
+{
+    enum Phase
+    {
+        PARSE,
+        NFA,
+        COMPRESS,
+        DETERMINIZE,
+        MINIMIZE,
+        PRODUCT,
+        REVERSE,
+        PHASE_COUNT
+    };
+
+    static constexpr const char *phaseNames[PHASE_COUNT] = {"parse", "nfa", "compress", "determinize",
+                                                            "minimize", "product", "reverse"};
+
+#ifdef FSA_METRICS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    // phases nest (a product determinizes its operands), so their times are inclusive
+    std::array<uint64_t, PHASE_COUNT> phaseCalls{};
+    std::array<uint64_t, PHASE_COUNT> phaseNanoseconds{};
+
+    // input and output of the most recent determinize and minimize
+    uint64_t nfaStates = 0, nfaTransitions = 0;
+    uint64_t dfaStates = 0, dfaTransitions = 0;
+    uint64_t minimizedStates = 0, minimizedTransitions = 0;
+
+    // lookups of a successor subset and how many found one that was already interned
+    uint64_t subsetLookups = 0, subsetHits = 0;
+    uint64_t refinementSplits = 0;
+
+    // lookups of a subexpression in the process-wide compile cache and how many found it
+    uint64_t cacheLookups = 0, cacheHits = 0;
+
+    // components of the epsilon graph of the most recent epsilon removal, and the states of the
+    // epsilon-free NFA the most recent determinize ran on
+    uint64_t epsilonComponents = 0, epsilonFreeStates = 0;
+
+    // terms interned by the derivative engine and derivatives computed rather than memoized
+    uint64_t derivativeTerms = 0, derivatives = 0;
+
+    // the counters of the calling thread
+    static Metrics &current()
+    {
+        static thread_local Metrics metrics;
+        return metrics;
+    }
+
+    void reset() { *this = Metrics(); }
+
+    double subsetHitRate() const { return subsetLookups ? static_cast<double>(subsetHits) / subsetLookups : 0; }
+
+    static uint64_t peakMemory()
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+        {
+            return 0;
+        }
+        // ru_maxrss is in kilobytes on Linux
+        return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+    }
+
+    std::string toJSON() const
+    {
+        std::string json = "{\"enabled\":" + std::string(enabled ? "true" : "false") + ",\"phases\":{";
+        for (size_t phase = 0; phase < PHASE_COUNT; phase++)
+        {
+            json += (phase ? ",\"" : "\"") + std::string(phaseNames[phase]) + "\":{\"calls\":" +
+                    std::to_string(phaseCalls[phase]) + ",\"ns\":" + std::to_string(phaseNanoseconds[phase]) + "}";
+        }
+        json += "},\"nfa_states\":" + std::to_string(nfaStates) + ",\"nfa_transitions\":" + std::to_string(nfaTransitions) +
+                ",\"dfa_states\":" + std::to_string(dfaStates) + ",\"dfa_transitions\":" + std::to_string(dfaTransitions) +
+                ",\"min_states\":" + std::to_string(minimizedStates) +
+                ",\"min_transitions\":" + std::to_string(minimizedTransitions) +
+                ",\"subset_lookups\":" + std::to_string(subsetLookups) + ",\"subset_hits\":" + std::to_string(subsetHits) +
+                ",\"subset_hit_rate\":" + std::to_string(subsetHitRate()) +
+                ",\"refinement_splits\":" + std::to_string(refinementSplits) +
+                ",\"cache_lookups\":" + std::to_string(cacheLookups) + ",\"cache_hits\":" + std::to_string(cacheHits) +
+                ",\"epsilon_components\":" + std::to_string(epsilonComponents) +
+                ",\"epsilon_free_states\":" + std::to_string(epsilonFreeStates) +
+                ",\"derivative_terms\":" + std::to_string(derivativeTerms) + ",\"derivatives\":" + std::to_string(derivatives) +
+                ",\"peak_memory_bytes\":" + std::to_string(peakMemory()) + "}";
+        return json;
+    }
+};
+
+#ifdef FSA_METRICS
+
+// Adds the wall time of its scope to a phase.
+class PhaseTimer
+{
+private:
+    Metrics::Phase phase;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit PhaseTimer(Metrics::Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+    PhaseTimer(const PhaseTimer &) = delete;
+    ~PhaseTimer()
+    {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        Metrics &metrics = Metrics::current();
+        metrics.phaseCalls[phase]++;
+        metrics.phaseNanoseconds[phase] += static_cast<uint64_t>(elapsed.count());
+    }
+};
+
+#define FSA_METRIC_PHASE(phase) PhaseTimer fsaPhaseTimer(Metrics::phase)
+#define FSA_METRIC_ADD(field, value) (Metrics::current().field += (value))
+#define FSA_METRIC_SET(field, value) (Metrics::current().field = (value))
+
+#else
+
+// the arguments are not evaluated, so they may be as expensive as needed
+#define FSA_METRIC_PHASE(phase)
+#define FSA_METRIC_ADD(field, value) ((void)0)
+#define FSA_METRIC_SET(field, value) ((void)0)
+
+#endif
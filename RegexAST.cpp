@@ -0,0 +1,258 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stack>
+#include <stdexcept>
+#include <cstdint>
+
+#include "Metrics.cpp"
+
+// A node of the expression tree. Symbol nodes have op == 0, unary operators ('*', '^', '~')
+// only use left, and binary operators ('&', '|', '%', '-') use left and right.
+struct RegexNode
+{
+    char op;
+    char symbol;
+    uint32_t left;
+    uint32_t right;
+
+    bool operator==(const RegexNode &other) const
+    {
+        return op == other.op && symbol == other.symbol && left == other.left && right == other.right;
+    }
+};
+
+struct RegexNodeHash
+{
+    std::size_t operator()(const RegexNode &node) const
+    {
+        uint64_t h = (static_cast<uint64_t>(static_cast<unsigned char>(node.op)) << 8 |
+                      static_cast<unsigned char>(node.symbol)) * 0x9E3779B97F4A7C15ull;
+        h = (h ^ node.left) * 0xFF51AFD7ED558CCDull;
+        h = (h ^ node.right) * 0xC4CEB9FE1A85EC53ull;
+        return h ^ (h >> 32);
+    }
+};
+
+// Syntax tree of an expression. The nodes live in one array and refer to their operands by
+// index; the parser appends every node after its operands, so the array is in post-order and
+// evaluating it front to back performs the operators in the order the expression dictates.
+// Structurally identical subtrees are hash-consed into one node, which makes the tree a DAG
+// whose shared nodes are operands of several others.
+class RegexAST
+{
+private:
+    // open-addressing table of node index + 1, 0 for an empty slot
+    std::vector<uint32_t> interned;
+
+    void apply(std::stack<uint32_t> &operands, char op);
+
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    std::vector<RegexNode> nodes;
+    uint32_t root;
+
+    RegexAST() : interned(64, 0), root(NONE) {}
+
+    static bool isOperator(char ch);
+    static bool isUnary(char op);
+    static int precedence(char op);
+
+    uint32_t add(char op, char symbol, uint32_t left = NONE, uint32_t right = NONE);
+
+    static RegexAST parse(const std::string &expression);
+};
+
+bool RegexAST::isOperator(char ch)
+{
+    return ch == '*' || ch == '&' || ch == '|' || ch == '^' || ch == '%' || ch == '-';
+}
+
+bool RegexAST::isUnary(char op)
+{
+    return op == '*' || op == '^' || op == '~';
+}
+
+int RegexAST::precedence(char op)
+{
+    switch (op)
+    {
+    case '*':
+    case '^':
+        return 4;
+    case '&':
+        return 3;
+    case '%':
+        return 2;
+    case '|':
+    case '-':
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+// returns the existing node when an identical one was added before
+uint32_t RegexAST::add(char op, char symbol, uint32_t left, uint32_t right)
+{
+    RegexNode node{op, symbol, left, right};
+    size_t mask = interned.size() - 1;
+    size_t slot = RegexNodeHash()(node) & mask;
+    for (; interned[slot] != 0; slot = (slot + 1) & mask)
+    {
+        if (nodes[interned[slot] - 1] == node)
+        {
+            return interned[slot] - 1;
+        }
+    }
+
+    nodes.push_back(node);
+    interned[slot] = static_cast<uint32_t>(nodes.size());
+    if (2 * nodes.size() > interned.size())
+    {
+        interned.assign(interned.size() * 2, 0);
+        mask = interned.size() - 1;
+        for (uint32_t i = 0; i < nodes.size(); i++)
+        {
+            for (slot = RegexNodeHash()(nodes[i]) & mask; interned[slot] != 0; slot = (slot + 1) & mask)
+            {
+            }
+            interned[slot] = i + 1;
+        }
+    }
+    return static_cast<uint32_t>(nodes.size() - 1);
+}
+
+void RegexAST::apply(std::stack<uint32_t> &operands, char op)
+{
+    if (operands.empty() || (!isUnary(op) && operands.size() < 2))
+    {
+        throw std::runtime_error("Missing operand for: " + std::string(1, op));
+    }
+
+    uint32_t a = operands.top();
+    operands.pop();
+
+    if (isUnary(op))
+    {
+        operands.push(add(op, 0, a));
+    }
+    else
+    {
+        uint32_t b = operands.top();
+        operands.pop();
+        operands.push(add(op, 0, b, a));
+    }
+}
+
+RegexAST RegexAST::parse(const std::string &expression)
+{
+    FSA_METRIC_PHASE(PARSE);
+
+    RegexAST ast;
+    // an expression has fewer nodes than twice its length, so the table never grows
+    size_t slots = ast.interned.size();
+    while (slots < 4 * expression.size())
+    {
+        slots *= 2;
+    }
+    ast.interned.assign(slots, 0);
+    std::stack<uint32_t> operands;
+    std::stack<char> operators;
+
+    bool expect_operator = false;
+
+    for (char ch : expression)
+    {
+        if (isspace(ch))
+        {
+            continue;
+        }
+
+        if (ch == '(')
+        {
+            if (expect_operator)
+            {
+                while (!operators.empty() && precedence('&') <= precedence(operators.top()))
+                {
+                    ast.apply(operands, operators.top());
+                    operators.pop();
+                }
+                operators.push('&');
+            }
+            operators.push(ch);
+            expect_operator = false;
+        }
+        else if (ch == ')')
+        {
+            while (!operators.empty() && operators.top() != '(')
+            {
+                ast.apply(operands, operators.top());
+                operators.pop();
+            }
+            if (operators.empty())
+            {
+                throw std::runtime_error("Unbalanced parenthesis");
+            }
+            operators.pop();
+            expect_operator = true;
+        }
+        else if (isUnary(ch))
+        {
+            if (!expect_operator)
+            {
+                throw std::runtime_error("Unexpected character: " + std::string(1, ch));
+            }
+            ast.apply(operands, ch);
+        }
+        else if (isOperator(ch))
+        {
+            while (!operators.empty() && precedence(ch) <= precedence(operators.top()))
+            {
+                ast.apply(operands, operators.top());
+                operators.pop();
+            }
+            operators.push(ch);
+            expect_operator = false;
+        }
+        else
+        {
+            if (expect_operator)
+            {
+                while (!operators.empty() && precedence('&') <= precedence(operators.top()))
+                {
+                    ast.apply(operands, operators.top());
+                    operators.pop();
+                }
+                operators.push('&');
+            }
+            operands.push(ast.add(0, ch));
+            expect_operator = true;
+        }
+    }
+
+    while (!operators.empty())
+    {
+        if (operators.top() == '(')
+        {
+            throw std::runtime_error("Unbalanced parenthesis");
+        }
+        ast.apply(operands, operators.top());
+        operators.pop();
+    }
+
+    if (operands.empty())
+    {
+        throw std::runtime_error("Empty expression");
+    }
+
+    while (operands.size() != 1)
+    {
+        ast.apply(operands, '&');
+    }
+
+    ast.root = operands.top();
+    return ast;
+}
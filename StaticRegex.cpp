@@ -0,0 +1,441 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+// A complete DFA over the byte classes of one pattern, built during constant evaluation by
+// compileStatic. Class 0 holds every byte the pattern does not mention. As a constexpr object
+// its table is known to the compiler, which can then specialize the matching loop.
+template <size_t MaxStates, size_t MaxClasses>
+struct StaticDFA
+{
+    static constexpr uint8_t NO_STATE = UINT8_MAX;
+
+    std::array<std::array<uint8_t, MaxClasses>, MaxStates> next{};
+    std::array<bool, MaxStates> final{};
+    std::array<uint8_t, 256> classOf{};
+    uint8_t states = 0;
+    uint8_t classes = 0;
+    uint8_t initial = 0;
+    // the non-final state that loops to itself on every class, if there is one
+    uint8_t dead = NO_STATE;
+
+    constexpr bool matches(const char *data, size_t length) const
+    {
+        uint8_t state = initial;
+        for (size_t i = 0; i < length; i++)
+        {
+            state = next[state][classOf[static_cast<unsigned char>(data[i])]];
+            if (state == dead)
+            {
+                return false;
+            }
+        }
+        return final[state];
+    }
+
+    constexpr bool matches(std::string_view word) const { return matches(word.data(), word.size()); }
+};
+
+// Compiles the expression language of RegexAST (symbols, '&', '|', '%', '-' and the postfix
+// '*', '^', '~') in a constant expression. Every subexpression is turned into a complete minimal
+// DFA right away; concatenation, star and reverse are subset constructions over bitmasks of
+// states, so every intermediate automaton must fit in MaxStates <= 64 states.
+template <size_t MaxStates, size_t MaxClasses>
+class StaticRegexCompiler
+{
+private:
+    using DFA = StaticDFA<MaxStates, MaxClasses>;
+
+    static_assert(MaxStates <= 64, "subsets of states are 64-bit masks");
+    // the number of classes is counted in a byte too, so it must stay below 256 for the overflow check to fire
+    static_assert(MaxStates < StaticDFA<MaxStates, MaxClasses>::NO_STATE && MaxClasses <= 255, "IDs are bytes");
+
+    // a state of the automaton under construction, such as a pair of states or a subset
+    struct Key
+    {
+        uint64_t first = 0, second = 0;
+
+        constexpr bool operator!=(const Key &other) const { return first != other.first || second != other.second; }
+    };
+
+    std::string_view pattern;
+    size_t position = 0;
+    std::array<uint8_t, 256> classOf{};
+    uint8_t classes = 1;
+
+    static constexpr bool isOperator(char ch)
+    {
+        return ch == '(' || ch == ')' || ch == '*' || ch == '&' || ch == '|' || ch == '^' || ch == '%' ||
+               ch == '-' || ch == '~';
+    }
+
+    static constexpr bool isSpace(char ch)
+    {
+        return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f' || ch == '\v';
+    }
+
+    constexpr char peek()
+    {
+        while (position < pattern.size() && isSpace(pattern[position]))
+        {
+            position++;
+        }
+        return position < pattern.size() ? pattern[position] : '\0';
+    }
+
+    constexpr bool atEnd()
+    {
+        peek();
+        return position == pattern.size();
+    }
+
+    constexpr DFA emptyDFA() const
+    {
+        DFA dfa;
+        dfa.classOf = classOf;
+        dfa.classes = classes;
+        return dfa;
+    }
+
+    // Explores the states reachable from start, where step(key, class) gives the key of a
+    // successor and accepting(key) tells whether a key is final, then minimizes the result.
+    template <typename Step, typename Accepting>
+    constexpr DFA explore(Key start, Step step, Accepting accepting) const
+    {
+        std::array<Key, MaxStates> keys{};
+        DFA dfa = emptyDFA();
+        keys[0] = start;
+        dfa.states = 1;
+        for (uint8_t state = 0; state < dfa.states; state++)
+        {
+            dfa.final[state] = accepting(keys[state]);
+            for (uint8_t cls = 0; cls < classes; cls++)
+            {
+                auto key = step(keys[state], cls);
+                uint8_t target = 0;
+                while (target < dfa.states && keys[target] != key)
+                {
+                    target++;
+                }
+                if (target == dfa.states)
+                {
+                    if (dfa.states == MaxStates)
+                    {
+                        throw std::length_error("Expression needs more states than StaticDFA provides");
+                    }
+                    keys[dfa.states++] = key;
+                }
+                dfa.next[state][cls] = target;
+            }
+        }
+        return minimize(dfa);
+    }
+
+    // Moore refinement, then the blocks become the states
+    constexpr DFA minimize(const DFA &dfa) const
+    {
+        std::array<uint8_t, MaxStates> block{}, refined{};
+        for (uint8_t q = 0; q < dfa.states; q++)
+        {
+            block[q] = dfa.final[q] != dfa.final[0];
+        }
+
+        uint8_t blocks = 0;
+        while (true)
+        {
+            uint8_t count = 0;
+            std::array<uint8_t, MaxStates> representative{};
+            for (uint8_t q = 0; q < dfa.states; q++)
+            {
+                uint8_t b = 0;
+                while (b < count)
+                {
+                    uint8_t p = representative[b];
+                    bool same = block[p] == block[q];
+                    for (uint8_t cls = 0; cls < classes && same; cls++)
+                    {
+                        same = block[dfa.next[p][cls]] == block[dfa.next[q][cls]];
+                    }
+                    if (same)
+                    {
+                        break;
+                    }
+                    b++;
+                }
+                if (b == count)
+                {
+                    representative[count++] = q;
+                }
+                refined[q] = b;
+            }
+            block = refined;
+            if (count == blocks)
+            {
+                break;
+            }
+            blocks = count;
+        }
+
+        DFA minimal = emptyDFA();
+        minimal.states = blocks;
+        minimal.initial = block[dfa.initial];
+        for (uint8_t q = 0; q < dfa.states; q++)
+        {
+            minimal.final[block[q]] = dfa.final[q];
+            for (uint8_t cls = 0; cls < classes; cls++)
+            {
+                minimal.next[block[q]][cls] = block[dfa.next[q][cls]];
+            }
+        }
+        for (uint8_t q = 0; q < minimal.states && minimal.dead == DFA::NO_STATE; q++)
+        {
+            bool loops = !minimal.final[q];
+            for (uint8_t cls = 0; cls < classes && loops; cls++)
+            {
+                loops = minimal.next[q][cls] == q;
+            }
+            if (loops)
+            {
+                minimal.dead = q;
+            }
+        }
+        return minimal;
+    }
+
+    constexpr DFA symbol(uint8_t cls) const
+    {
+        // 0 --cls--> 1, everything else leads to 2
+        DFA dfa = emptyDFA();
+        dfa.states = 3;
+        dfa.final[1] = true;
+        for (uint8_t c = 0; c < classes; c++)
+        {
+            dfa.next[0][c] = c == cls ? 1 : 2;
+            dfa.next[1][c] = 2;
+            dfa.next[2][c] = 2;
+        }
+        dfa.dead = 2;
+        return dfa;
+    }
+
+    constexpr DFA product(const DFA &a, const DFA &b, char op) const
+    {
+        // pairs that can no longer accept are all the same state, {MaxStates, MaxStates}
+        auto collapse = [&](Key key) -> Key
+        {
+            bool left = key.first == a.dead, right = key.second == b.dead;
+            bool hopeless = op == '|' ? left && right : op == '%' ? left || right : left;
+            return hopeless ? Key{MaxStates, MaxStates} : key;
+        };
+        return explore(
+            collapse({a.initial, b.initial}),
+            [&](Key key, uint8_t cls) -> Key
+            { return key.first == MaxStates ? key : collapse({a.next[key.first][cls], b.next[key.second][cls]}); },
+            [&](Key key)
+            {
+                if (key.first == MaxStates)
+                {
+                    return false;
+                }
+                bool left = a.final[key.first], right = b.final[key.second];
+                return op == '|' ? left || right : op == '%' ? left && right : left && !right;
+            });
+    }
+
+    static constexpr uint64_t bit(uint64_t state) { return uint64_t(1) << state; }
+
+    // the live states of dfa reached from the states in mask on cls; leaving out the dead state
+    // keeps subsets that only differ in it from becoming separate states
+    static constexpr uint64_t move(const DFA &dfa, uint64_t mask, uint8_t cls)
+    {
+        uint64_t result = 0;
+        for (uint8_t q = 0; q < dfa.states; q++)
+        {
+            if (mask & bit(q) && dfa.next[q][cls] != dfa.dead)
+            {
+                result |= bit(dfa.next[q][cls]);
+            }
+        }
+        return result;
+    }
+
+    static constexpr uint64_t finalMask(const DFA &dfa)
+    {
+        uint64_t mask = 0;
+        for (uint8_t q = 0; q < dfa.states; q++)
+        {
+            mask |= dfa.final[q] ? bit(q) : 0;
+        }
+        return mask;
+    }
+
+    constexpr DFA concatenate(const DFA &a, const DFA &b) const
+    {
+        // a state of a together with the states of b that are active
+        return explore(
+            {a.initial, a.final[a.initial] ? bit(b.initial) : 0},
+            [&](Key key, uint8_t cls) -> Key
+            {
+                uint8_t left = a.next[key.first][cls];
+                return {left, move(b, key.second, cls) | (a.final[left] ? bit(b.initial) : 0)};
+            },
+            [&](Key key)
+            { return (key.second & finalMask(b)) != 0; });
+    }
+
+    constexpr DFA star(const DFA &a) const
+    {
+        // the first member flags the initial state, which accepts the empty word
+        return explore(
+            {1, bit(a.initial)},
+            [&](Key key, uint8_t cls) -> Key
+            {
+                uint64_t mask = move(a, key.second, cls);
+                return {0, mask & finalMask(a) ? mask | bit(a.initial) : mask};
+            },
+            [&](Key key)
+            { return key.first == 1 || (key.second & finalMask(a)) != 0; });
+    }
+
+    constexpr DFA reverse(const DFA &a) const
+    {
+        // the states of a from which the active states are reached
+        return explore(
+            {0, finalMask(a)},
+            [&](Key key, uint8_t cls) -> Key
+            {
+                uint64_t mask = 0;
+                for (uint8_t q = 0; q < a.states; q++)
+                {
+                    mask |= key.second & bit(a.next[q][cls]) ? bit(q) : 0;
+                }
+                return {0, mask};
+            },
+            [&](Key key)
+            { return (key.second & bit(a.initial)) != 0; });
+    }
+
+    constexpr DFA complement(DFA a) const
+    {
+        for (uint8_t q = 0; q < a.states; q++)
+        {
+            a.final[q] = !a.final[q];
+        }
+        return minimize(a);
+    }
+
+    // alternation and difference bind loosest, then intersection, then concatenation; the
+    // postfix operators apply to the operand right before them
+    constexpr DFA parseAlternation()
+    {
+        DFA result = parseIntersection();
+        while (peek() == '|' || peek() == '-')
+        {
+            char op = pattern[position++];
+            result = product(result, parseIntersection(), op);
+        }
+        return result;
+    }
+
+    constexpr DFA parseIntersection()
+    {
+        DFA result = parseConcatenation();
+        while (peek() == '%')
+        {
+            position++;
+            result = product(result, parseConcatenation(), '%');
+        }
+        return result;
+    }
+
+    constexpr DFA parseConcatenation()
+    {
+        DFA result = parsePostfix();
+        while (!atEnd() && (peek() == '&' || peek() == '(' || !isOperator(peek())))
+        {
+            if (peek() == '&')
+            {
+                position++;
+            }
+            result = concatenate(result, parsePostfix());
+        }
+        return result;
+    }
+
+    constexpr DFA parsePostfix()
+    {
+        DFA result = parseAtom();
+        while (peek() == '*' || peek() == '^' || peek() == '~')
+        {
+            char op = pattern[position++];
+            result = op == '*' ? star(result) : op == '^' ? reverse(result) : complement(result);
+        }
+        return result;
+    }
+
+    constexpr DFA parseAtom()
+    {
+        char ch = peek();
+        if (atEnd() || (isOperator(ch) && ch != '('))
+        {
+            throw std::runtime_error("Missing operand");
+        }
+        position++;
+        if (ch != '(')
+        {
+            return symbol(classOf[static_cast<unsigned char>(ch)]);
+        }
+        DFA result = parseAlternation();
+        if (peek() != ')')
+        {
+            throw std::runtime_error("Unbalanced parenthesis");
+        }
+        position++;
+        return result;
+    }
+
+public:
+    constexpr explicit StaticRegexCompiler(std::string_view pattern) : pattern(pattern)
+    {
+        // one class per distinct symbol in order of appearance, class 0 for every other byte
+        for (char ch : pattern)
+        {
+            unsigned char byte = static_cast<unsigned char>(ch);
+            if (isOperator(ch) || isSpace(ch) || classOf[byte] != 0)
+            {
+                continue;
+            }
+            if (classes == MaxClasses)
+            {
+                throw std::length_error("Expression uses more symbols than StaticDFA provides");
+            }
+            classOf[byte] = classes++;
+        }
+    }
+
+    constexpr DFA compile()
+    {
+        if (atEnd())
+        {
+            throw std::runtime_error("Empty expression");
+        }
+        DFA result = parseAlternation();
+        if (!atEnd())
+        {
+            throw std::runtime_error("Unbalanced parenthesis");
+        }
+        return result;
+    }
+};
+
+// Compiles an expression to a StaticDFA. Used in a constant expression, e.g.
+//     static constexpr auto pattern = compileStatic("(a|b)*abb");
+// parse errors and patterns that do not fit become compile errors.
+template <size_t MaxStates = 64, size_t MaxClasses = 32>
+constexpr StaticDFA<MaxStates, MaxClasses> compileStatic(std::string_view expression)
+{
+    return StaticRegexCompiler<MaxStates, MaxClasses>(expression).compile();
+}
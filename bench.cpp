@@ -0,0 +1,324 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "FSA.cpp"
+#include "DenseDFA.cpp"
+#include "Matcher.cpp"
+#include "StaticRegex.cpp"
+
+// Benchmarks the construction pipeline phase by phase over parameterized expression families.
+// Every configuration is run several times and reported as one JSON object per line.
+
+struct Family
+{
+    std::string name;
+    std::vector<size_t> sizes;
+    std::function<std::string(size_t)> expression;
+};
+
+struct PhaseTimes
+{
+    std::vector<double> parse, nfa, determinize, minimize, match, batch;
+};
+
+static std::vector<Family> families()
+{
+    return {
+        // (a|b)*a(a|b)^n: the n-th symbol from the end is an 'a', 2^(n+1) DFA states
+        {"nth_from_end", {4, 8, 12}, [](size_t n)
+         {
+             std::string e = "(a|b)*a";
+             for (size_t i = 0; i < n; i++)
+             {
+                 e += "(a|b)";
+             }
+             return e;
+         }},
+        // stars nested n deep: (((a*b)*c)*d)*...
+        {"deep_nesting", {4, 16, 64}, [](size_t n)
+         {
+             std::string e = "a";
+             for (size_t i = 0; i < n; i++)
+             {
+                 e = "(" + e + "*" + std::string(1, "bcd"[i % 3]) + ")";
+             }
+             return e + "*";
+         }},
+        // n symbols in a row
+        {"long_concatenation", {100, 1000, 10000}, [](size_t n)
+         {
+             std::string e;
+             for (size_t i = 0; i < n; i++)
+             {
+                 e += "abcd"[i % 4];
+             }
+             return e;
+         }},
+        // one fragment repeated n times between separators, as generated from a template
+        {"repeated_fragment", {4, 16, 64}, [](size_t n)
+         {
+             std::string e;
+             for (size_t i = 0; i < n; i++)
+             {
+                 e += "(((a|b)*c|(b|d)*a)*d)" + std::string(1, "abcd"[i % 4]);
+             }
+             return e;
+         }},
+        // complement, reverse and union applied in turn n times
+        {"complement_reverse_union", {2, 4, 8}, [](size_t n)
+         {
+             std::string e = "ab";
+             for (size_t i = 0; i < n; i++)
+             {
+                 e = "((" + e + ")~^|" + std::string(1, "abcd"[i % 4]) + "c)";
+             }
+             return e;
+         }},
+    };
+}
+
+// nth_from_end of size 4 compiled at build time, matched against the same input as the runtime tables
+static constexpr auto staticNthFromEnd = compileStatic("(a|b)*a(a|b)(a|b)(a|b)(a|b)");
+
+template <typename Step>
+static double measure(Step &&step)
+{
+    auto start = std::chrono::steady_clock::now();
+    step();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static std::string summary(std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    double mean = 0;
+    for (double sample : samples)
+    {
+        mean += sample / samples.size();
+    }
+    return "{\"min\":" + std::to_string(samples.front()) + ",\"median\":" + std::to_string(samples[samples.size() / 2]) +
+           ",\"mean\":" + std::to_string(mean) + "}";
+}
+
+// newline separated random words over a..d, the same for every run
+static std::string matchInput(size_t bytes)
+{
+    std::mt19937 random(42);
+    std::string input;
+    input.reserve(bytes);
+    while (input.size() < bytes)
+    {
+        size_t length = 1 + random() % 64;
+        for (size_t i = 0; i < length; i++)
+        {
+            input += "abcd"[random() % 4];
+        }
+        input += '\n';
+    }
+    return input;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t repetitions = 5;
+    size_t inputBytes = 1 << 22;
+    std::string only;
+    size_t threads = 1;
+    std::string minimizer = "auto";
+    FSA::Minimization minimization = FSA::Minimization::Automatic;
+    std::string layoutName = "bfs";
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option{argv[i]};
+        if (option == "--reps" && i + 1 < argc)
+        {
+            repetitions = std::max<size_t>(1, std::stoul(argv[++i]));
+        }
+        else if (option == "--input" && i + 1 < argc)
+        {
+            inputBytes = std::stoul(argv[++i]);
+        }
+        else if (option == "--family" && i + 1 < argc)
+        {
+            only = argv[++i];
+        }
+        else if (option == "--threads" && i + 1 < argc)
+        {
+            threads = std::stoul(argv[++i]);
+        }
+        else if (option == "--minimizer" && i + 1 < argc &&
+                 (std::string(argv[i + 1]) == "auto" || std::string(argv[i + 1]) == "sequential" ||
+                  std::string(argv[i + 1]) == "parallel"))
+        {
+            minimizer = argv[++i];
+            minimization = minimizer == "sequential" ? FSA::Minimization::Sequential
+                           : minimizer == "parallel" ? FSA::Minimization::Parallel
+                                                     : FSA::Minimization::Automatic;
+        }
+        else if (option == "--layout" && i + 1 < argc &&
+                 (std::string(argv[i + 1]) == "bfs" || std::string(argv[i + 1]) == "dfs" ||
+                  std::string(argv[i + 1]) == "hot" || std::string(argv[i + 1]) == "profile"))
+        {
+            layoutName = argv[++i];
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--reps N] [--input BYTES] [--family NAME] [--threads N]"
+                      << " [--minimizer auto|sequential|parallel] [--layout bfs|dfs|hot|profile]\n";
+            return 1;
+        }
+    }
+
+    std::string input = matchInput(inputBytes);
+    // the same lines as one batch for matchBatch: their bytes back to back and where each starts
+    std::string batchBytes;
+    std::vector<size_t> batchOffsets{0};
+    for (char ch : input)
+    {
+        if (ch == '\n')
+        {
+            batchOffsets.push_back(batchBytes.size());
+        }
+        else
+        {
+            batchBytes += ch;
+        }
+    }
+    size_t batchCount = batchOffsets.size() - 1;
+    // profile lays the states out by their visits while matching the input itself
+    DenseDFA::Layout layout = layoutName == "dfs"   ? DenseDFA::Layout::DepthFirst
+                              : layoutName == "hot" ? DenseDFA::Layout::HotFirst
+                                                    : DenseDFA::Layout::BreadthFirst;
+    std::vector<std::pair<std::string, FSA::Engine>> engines = {{"thompson", FSA::Engine::Thompson},
+                                                                {"glushkov", FSA::Engine::Glushkov},
+                                                                {"brzozowski", FSA::Engine::Brzozowski}};
+
+    for (const auto &family : families())
+    {
+        if (!only.empty() && family.name != only)
+        {
+            continue;
+        }
+        for (size_t size : family.sizes)
+        {
+            std::string expression = family.expression(size);
+            for (const auto &[engineName, engine] : engines)
+            {
+                PhaseTimes times;
+                size_t nfaStates = 0, nfaTransitions = 0, dfaStates = 0, minStates = 0, minTransitions = 0, matched = 0;
+                size_t batchMatched = 0;
+
+                for (size_t repetition = 0; repetition < repetitions; repetition++)
+                {
+                    Metrics::current().reset();
+                    // every repetition compiles from scratch, sharing only within the expression
+                    CompileCache::global().clear();
+                    RegexAST ast;
+                    FSA *automaton = nullptr;
+
+                    times.parse.push_back(measure([&]
+                                                  { ast = RegexAST::parse(expression); }));
+                    times.nfa.push_back(measure([&]
+                                                { automaton = FSA::fromAST(ast, engine); }));
+                    nfaStates = automaton->stateCount();
+                    nfaTransitions = automaton->transitionCount();
+
+                    times.determinize.push_back(measure([&]
+                                                        {
+                                                            automaton->compressAlphabet();
+                                                            automaton->determinize(threads); }));
+                    dfaStates = automaton->stateCount();
+
+                    times.minimize.push_back(measure([&]
+                                                     {
+                                                         automaton->minimize(threads, minimization);
+                                                         automaton->compressAlphabet(); }));
+                    minStates = automaton->stateCount();
+                    minTransitions = automaton->transitionCount();
+
+                    DenseDFA dense(*automaton, layout);
+                    if (layoutName == "profile")
+                    {
+                        std::vector<uint64_t> visits;
+                        Matcher profiler(dense);
+                        for (size_t i = 0; i < batchCount; i++)
+                        {
+                            profiler.profile(batchBytes.data() + batchOffsets[i], batchOffsets[i + 1] - batchOffsets[i], visits);
+                        }
+                        dense.reorder(visits);
+                    }
+                    Matcher matcher(dense);
+                    times.match.push_back(measure([&]
+                                                  { matched = matcher.scanLines(input.data(), input.size(), [](const char *, size_t) {}); }));
+                    std::vector<uint64_t> accepted;
+                    times.batch.push_back(measure([&]
+                                                  { accepted = matcher.matchBatch(batchBytes.data(), batchOffsets.data(), batchCount); }));
+                    batchMatched = 0;
+                    for (uint64_t word : accepted)
+                    {
+                        batchMatched += __builtin_popcountll(word);
+                    }
+                    delete automaton;
+                }
+
+                std::sort(times.match.begin(), times.match.end());
+                double throughput = input.size() / (times.match[times.match.size() / 2] / 1e9) / (1 << 20);
+                std::sort(times.batch.begin(), times.batch.end());
+                double batchThroughput = batchBytes.size() / (times.batch[times.batch.size() / 2] / 1e9) / (1 << 20);
+
+                std::cout << "{\"family\":\"" << family.name << "\",\"size\":" << size << ",\"engine\":\"" << engineName
+                          << "\",\"repetitions\":" << repetitions << ",\"threads\":" << threads << ",\"minimizer\":\"" << minimizer << "\""
+                          << ",\"layout\":\"" << layoutName << "\""
+                          << ",\"nfa_states\":" << nfaStates << ",\"nfa_transitions\":" << nfaTransitions
+                          << ",\"dfa_states\":" << dfaStates << ",\"min_states\":" << minStates
+                          << ",\"min_transitions\":" << minTransitions << ",\"matched_lines\":" << matched
+                          << ",\"parse_ns\":" << summary(times.parse) << ",\"nfa_ns\":" << summary(times.nfa)
+                          << ",\"determinize_ns\":" << summary(times.determinize) << ",\"minimize_ns\":" << summary(times.minimize)
+                          << ",\"match_ns\":" << summary(times.match) << ",\"match_mib_per_s\":" << throughput
+                          << ",\"batch_matched\":" << batchMatched << ",\"batch_ns\":" << summary(times.batch)
+                          << ",\"batch_mib_per_s\":" << batchThroughput;
+                if (Metrics::enabled)
+                {
+                    // counters of the last repetition
+                    std::cout << ",\"metrics\":" << Metrics::current().toJSON();
+                }
+                std::cout << "}\n";
+            }
+        }
+    }
+
+    if (only.empty() || only == "nth_from_end")
+    {
+        std::vector<double> match;
+        size_t matched = 0;
+        for (size_t repetition = 0; repetition < repetitions; repetition++)
+        {
+            match.push_back(measure([&]
+                                    {
+                                        matched = 0;
+                                        const char *data = input.data(), *end = data + input.size();
+                                        while (data < end)
+                                        {
+                                            const char *newline = static_cast<const char *>(std::memchr(data, '\n', end - data));
+                                            const char *lineEnd = newline ? newline : end;
+                                            matched += staticNthFromEnd.matches(data, lineEnd - data);
+                                            data = lineEnd + 1;
+                                        } }));
+        }
+
+        std::sort(match.begin(), match.end());
+        double throughput = input.size() / (match[match.size() / 2] / 1e9) / (1 << 20);
+        std::cout << "{\"family\":\"nth_from_end\",\"size\":4,\"engine\":\"constexpr\",\"repetitions\":" << repetitions
+                  << ",\"min_states\":" << static_cast<size_t>(staticNthFromEnd.states) << ",\"matched_lines\":" << matched
+                  << ",\"match_ns\":" << summary(match) << ",\"match_mib_per_s\":" << throughput << "}\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "FSA.cpp"
+#include "DenseDFA.cpp"
+#include "Matcher.cpp"
+#include "LazyDFA.cpp"
+#include "StaticRegex.cpp"
+
+// Differential check of the constructions on random expressions. The language of every
+// expression is evaluated directly on all words up to a small length and compared with what each
+// engine, the lazy DFA, the parallel determinization and minimization and the constexpr compiler
+// accept; the minimal DFAs must also have the same size however they were built, the compile
+// cache must not change the result and exported counts must match the running ones.
+
+// 'x' appears in no expression, so it exercises the bytes an expression does not mention
+static const std::string ALPHABET = "abcx";
+static constexpr size_t MAX_LENGTH = 5;
+
+// Sets of words of at most MAX_LENGTH symbols. The words of one length are numbered as base
+// |ALPHABET| numbers, after all the shorter words.
+class Language
+{
+private:
+    static size_t power(size_t length)
+    {
+        size_t result = 1;
+        for (size_t i = 0; i < length; i++)
+        {
+            result *= ALPHABET.size();
+        }
+        return result;
+    }
+
+    static size_t index(size_t length, size_t value) { return (power(length) - 1) / (ALPHABET.size() - 1) + value; }
+
+public:
+    std::vector<bool> contains;
+
+    Language() : contains(index(MAX_LENGTH + 1, 0), false) {}
+
+    static std::string word(size_t length, size_t value);
+    static size_t size() { return index(MAX_LENGTH + 1, 0); }
+
+    static Language symbol(char ch);
+    static Language evaluate(const RegexAST &ast);
+
+    Language concatenation(const Language &other) const;
+    Language star() const;
+    Language reversal() const;
+    Language combination(const Language &other, char op) const;
+
+    template <typename Accepts>
+    bool sameAs(Accepts &&accepts) const;
+};
+
+std::string Language::word(size_t length, size_t value)
+{
+    std::string result(length, ALPHABET[0]);
+    for (size_t i = length; i-- > 0; value /= ALPHABET.size())
+    {
+        result[i] = ALPHABET[value % ALPHABET.size()];
+    }
+    return result;
+}
+
+Language Language::symbol(char ch)
+{
+    Language result;
+    result.contains[index(1, ALPHABET.find(ch))] = true;
+    return result;
+}
+
+Language Language::concatenation(const Language &other) const
+{
+    Language result;
+    for (size_t i = 0; i <= MAX_LENGTH; i++)
+    {
+        for (size_t u = 0; u < power(i); u++)
+        {
+            if (!contains[index(i, u)])
+            {
+                continue;
+            }
+            for (size_t j = 0; i + j <= MAX_LENGTH; j++)
+            {
+                for (size_t v = 0; v < power(j); v++)
+                {
+                    if (other.contains[index(j, v)])
+                    {
+                        result.contains[index(i + j, u * power(j) + v)] = true;
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+Language Language::star() const
+{
+    Language result;
+    result.contains[index(0, 0)] = true;
+    while (true)
+    {
+        Language next = result.combination(result.concatenation(*this), '|');
+        if (next.contains == result.contains)
+        {
+            return result;
+        }
+        result = std::move(next);
+    }
+}
+
+Language Language::reversal() const
+{
+    Language result;
+    for (size_t length = 0; length <= MAX_LENGTH; length++)
+    {
+        for (size_t value = 0; value < power(length); value++)
+        {
+            size_t reversed = 0;
+            for (size_t rest = value, i = 0; i < length; i++, rest /= ALPHABET.size())
+            {
+                reversed = reversed * ALPHABET.size() + rest % ALPHABET.size();
+            }
+            result.contains[index(length, reversed)] = contains[index(length, value)];
+        }
+    }
+    return result;
+}
+
+// '|' union, '%' intersection, '-' difference and '~' the complement of this language
+Language Language::combination(const Language &other, char op) const
+{
+    Language result;
+    for (size_t i = 0; i < contains.size(); i++)
+    {
+        result.contains[i] = op == '|'   ? contains[i] || other.contains[i]
+                             : op == '%' ? contains[i] && other.contains[i]
+                             : op == '-' ? contains[i] && !other.contains[i]
+                                         : !contains[i];
+    }
+    return result;
+}
+
+// the nodes are in post-order, so every operand is evaluated before its operator
+Language Language::evaluate(const RegexAST &ast)
+{
+    std::vector<Language> value(ast.nodes.size());
+    for (size_t i = 0; i < ast.nodes.size(); i++)
+    {
+        const RegexNode &node = ast.nodes[i];
+        switch (node.op)
+        {
+        case 0:
+            value[i] = symbol(node.symbol);
+            break;
+        case '&':
+            value[i] = value[node.left].concatenation(value[node.right]);
+            break;
+        case '*':
+            value[i] = value[node.left].star();
+            break;
+        case '^':
+            value[i] = value[node.left].reversal();
+            break;
+        case '~':
+            value[i] = value[node.left].combination(value[node.left], '~');
+            break;
+        default:
+            value[i] = value[node.left].combination(value[node.right], node.op);
+        }
+    }
+    return value[ast.root];
+}
+
+template <typename Accepts>
+bool Language::sameAs(Accepts &&accepts) const
+{
+    for (size_t length = 0; length <= MAX_LENGTH; length++)
+    {
+        for (size_t value = 0; value < power(length); value++)
+        {
+            if (accepts(word(length, value)) != contains[index(length, value)])
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// an expression over a, b and c with at most depth nested operators
+static std::string randomExpression(std::mt19937 &random, size_t depth)
+{
+    if (depth == 0 || random() % 4 == 0)
+    {
+        return std::string(1, "abc"[random() % 3]);
+    }
+    if (random() % 2 == 0)
+    {
+        return "(" + randomExpression(random, depth - 1) + "&|%-&"[random() % 5] + randomExpression(random, depth - 1) + ")";
+    }
+    return "(" + randomExpression(random, depth - 1) + ")" + "*^~"[random() % 3];
+}
+
+// the edge list of an automaton with its lines sorted, since states are listed in hash order
+static std::string edges(const FSA &automaton, size_t &states, size_t &transitions)
+{
+    std::ostringstream out;
+    {
+        EdgeListWriter writer(out);
+        automaton.write(writer);
+        states = writer.states();
+        transitions = writer.transitions();
+    }
+    std::vector<std::string> lines;
+    std::istringstream in(out.str());
+    for (std::string line; std::getline(in, line);)
+    {
+        lines.push_back(line);
+    }
+    std::sort(lines.begin(), lines.end());
+    std::string sorted;
+    for (const auto &line : lines)
+    {
+        sorted += line + '\n';
+    }
+    return sorted;
+}
+
+static bool accepts(const FSA &dfa, const Language &language)
+{
+    DenseDFA dense(dfa);
+    Matcher matcher(dense);
+    return language.sameAs([&](const std::string &word)
+                           { return matcher.matches(word); });
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = 300;
+    unsigned seed = 1;
+    size_t threads = 4;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option{argv[i]};
+        if (option == "--count" && i + 1 < argc)
+        {
+            count = std::stoul(argv[++i]);
+        }
+        else if (option == "--seed" && i + 1 < argc)
+        {
+            seed = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if (option == "--threads" && i + 1 < argc)
+        {
+            threads = std::max<size_t>(2, std::stoul(argv[++i]));
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--count N] [--seed S] [--threads N]\n";
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<std::string, FSA::Engine>> engines = {{"thompson", FSA::Engine::Thompson},
+                                                                {"glushkov", FSA::Engine::Glushkov},
+                                                                {"brzozowski", FSA::Engine::Brzozowski}};
+    std::mt19937 random(seed);
+    size_t failures = 0, staticChecked = 0;
+    // the expressions and the edges of their Thompson DFAs, compiled with the cache
+    std::vector<std::string> expressions;
+    std::vector<std::string> cachedEdges;
+    auto fail = [&](const std::string &what, const std::string &expression)
+    {
+        std::cout << "FAIL " << what << ": " << expression << '\n';
+        failures++;
+    };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string expression = randomExpression(random, 4);
+        expressions.push_back(expression);
+        RegexAST ast = RegexAST::parse(expression);
+        Language language = Language::evaluate(ast);
+        std::string minimal;
+        size_t states, transitions;
+
+        for (const auto &[name, engine] : engines)
+        {
+            std::unique_ptr<FSA> nfa(FSA::parseNFA(expression, engine));
+            edges(*nfa, states, transitions);
+            if (states != nfa->stateCount() || transitions != nfa->transitionCount())
+            {
+                fail(name + " NFA counts", expression);
+            }
+
+            std::unique_ptr<FSA> dfa(FSA::parseExpression(expression, engine));
+            std::string sequential = edges(*dfa, states, transitions);
+            if (engine == FSA::Engine::Thompson)
+            {
+                cachedEdges.push_back(sequential);
+            }
+            if (states != dfa->stateCount() || transitions != dfa->transitionCount())
+            {
+                fail(name + " DFA counts", expression);
+            }
+            if (!accepts(*dfa, language))
+            {
+                fail(name, expression);
+            }
+            // the minimal DFA is unique, so every engine must reach the same number of states and transitions
+            std::string size = std::to_string(states) + " " + std::to_string(transitions);
+            if (minimal.empty())
+            {
+                minimal = size;
+            }
+            else if (size != minimal)
+            {
+                fail(name + " minimal size " + size + " instead of " + minimal, expression);
+            }
+
+            std::unique_ptr<FSA> parallel(FSA::parseExpression(expression, engine, threads));
+            if (edges(*parallel, states, transitions) != sequential)
+            {
+                fail(name + " parallel determinization", expression);
+            }
+
+            std::unique_ptr<FSA> moore(FSA::fromAST(ast, engine));
+            moore->compressAlphabet();
+            moore->determinize(threads);
+            moore->minimize(threads, FSA::Minimization::Parallel);
+            moore->compressAlphabet();
+            edges(*moore, states, transitions);
+            if (std::to_string(states) + " " + std::to_string(transitions) != minimal || !accepts(*moore, language))
+            {
+                fail(name + " parallel minimization", expression);
+            }
+
+            LazyDFA lazy = LazyDFA::parse(expression, engine);
+            if (!language.sameAs([&](const std::string &word)
+                                 { return lazy.matches(word); }))
+            {
+                fail(name + " lazy", expression);
+            }
+        }
+
+        // compileStatic evaluated at run time, for the expressions that fit in its 64 states
+        try
+        {
+            auto compiled = compileStatic(expression);
+            staticChecked++;
+            if (!language.sameAs([&](const std::string &word)
+                                 { return compiled.matches(word); }))
+            {
+                fail("static", expression);
+            }
+        }
+        catch (const std::length_error &)
+        {
+        }
+    }
+
+    // the cache was shared by all the expressions above; compiling them without it must agree
+    CompileCache::global().setCapacity(0);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t states, transitions;
+        std::unique_ptr<FSA> uncached(FSA::parseExpression(expressions[i]));
+        if (edges(*uncached, states, transitions) != cachedEdges[i])
+        {
+            fail("compile cache", expressions[i]);
+        }
+    }
+
+    std::cout << count << " expressions (" << staticChecked << " also compiled statically), " << Language::size()
+              << " words each, " << failures << " failures\n";
+    return failures ? 1 : 0;
+}
@@ -1,3 +1,4 @@
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -5,31 +6,275 @@
 #include <map>
 
 #include "FSA.cpp"
+#include "DenseDFA.cpp"
+#include "Matcher.cpp"
+#include "LazyDFA.cpp"
+#include "MappedDFA.cpp"
+
+// matches the words given as arguments, the lines of a file (or stdin for "-") after -f, or
+// a whole file as one word after -w
+static void runMatcher(const Matcher &matcher, int argi, int argc, char *argv[], size_t threads)
+{
+    if ( argc == argi + 2 && std::string(argv[argi]) == "-w" )
+    {
+        std::cout << argv[argi + 1] << ": " << (matcher.matchesFile(argv[argi + 1], threads) ? "accepted" : "rejected") << '\n';
+    }
+    else if ( argc == argi + 2 && std::string(argv[argi]) == "-f" )
+    {
+        std::string path{argv[argi + 1]};
+        auto printLine = [](const char *line, size_t length)
+        {
+            std::cout.write(line, length);
+            std::cout.put('\n');
+        };
+        size_t matched = path == "-" ? matcher.scanLines(std::cin, printLine) : matcher.scanFile(path, printLine);
+        std::cerr << "matched lines: " << matched << '\n';
+    }
+    else
+    {
+        for (int i = argi; i < argc; i++)
+        {
+            std::cout << argv[i] << ": " << (matcher.matches(argv[i]) ? "accepted" : "rejected") << '\n';
+        }
+    }
+}
+
+// writes the automaton to stdout and its size to stderr
+template <typename Writer>
+static void exportAutomaton(const FSA &automaton)
+{
+    Writer writer(std::cout);
+    automaton.write(writer);
+    std::cerr << "exported states: " << writer.states() << ", transitions: " << writer.transitions() << '\n';
+}
+
+static void exportAutomaton(const FSA &automaton, const std::string &format)
+{
+    if ( format == "mermaid" )
+    {
+        exportAutomaton<MermaidWriter>(automaton);
+    }
+    else if ( format == "dot" )
+    {
+        exportAutomaton<DotWriter>(automaton);
+    }
+    else if ( format == "edges" )
+    {
+        exportAutomaton<EdgeListWriter>(automaton);
+    }
+}
+
+// renumbers the states of dfa by how often the lines of the sample file visit them
+static void profileLayout(DenseDFA &dfa, const std::string &path)
+{
+    std::ifstream file(path);
+    if ( !file )
+    {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+    Matcher matcher(dfa);
+    std::vector<uint64_t> visits;
+    for (std::string line; std::getline(file, line);)
+    {
+        matcher.profile(line.data(), line.size(), visits);
+    }
+    dfa.reorder(visits);
+}
 
 int main(int argc, char *argv[]) {
 
-    if ( argc < 2 )
+    FSA::Engine engine = FSA::Engine::Thompson;
+    bool lazy = false;
+    bool metrics = false;
+    size_t threads = 1;
+    DenseDFA::Layout layout = DenseDFA::Layout::BreadthFirst;
+    std::string savePath, loadPath, patternsPath, profilePath, exportFormat;
+    int argi = 1;
+    for (; argi < argc && std::string(argv[argi]).rfind("--", 0) == 0; argi++)
+    {
+        std::string option{argv[argi]};
+        if ( option == "--glushkov" )
+        {
+            engine = FSA::Engine::Glushkov;
+        }
+        else if ( option == "--brzozowski" )
+        {
+            engine = FSA::Engine::Brzozowski;
+        }
+        else if ( option == "--lazy" )
+        {
+            lazy = true;
+        }
+        else if ( option == "--metrics" )
+        {
+            metrics = true;
+        }
+        else if ( option == "--threads" && argi + 1 < argc )
+        {
+            threads = std::stoul(argv[++argi]);
+        }
+        else if ( option == "--layout" && argi + 1 < argc )
+        {
+            std::string name{argv[++argi]};
+            if ( name == "bfs" )
+            {
+                layout = DenseDFA::Layout::BreadthFirst;
+            }
+            else if ( name == "dfs" )
+            {
+                layout = DenseDFA::Layout::DepthFirst;
+            }
+            else if ( name == "hot" )
+            {
+                layout = DenseDFA::Layout::HotFirst;
+            }
+            else
+            {
+                std::cerr << "Unknown layout: " << name << '\n';
+                return 1;
+            }
+        }
+        else if ( option == "--profile" && argi + 1 < argc )
+        {
+            profilePath = argv[++argi];
+        }
+        else if ( option == "--export" && argi + 1 < argc )
+        {
+            exportFormat = argv[++argi];
+            if ( exportFormat != "mermaid" && exportFormat != "dot" && exportFormat != "edges" )
+            {
+                std::cerr << "Unknown export format: " << exportFormat << '\n';
+                return 1;
+            }
+        }
+        else if ( option == "--save" && argi + 1 < argc )
+        {
+            savePath = argv[++argi];
+        }
+        else if ( option == "--load" && argi + 1 < argc )
+        {
+            loadPath = argv[++argi];
+        }
+        else if ( option == "--patterns" && argi + 1 < argc )
+        {
+            patternsPath = argv[++argi];
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << option << '\n';
+            return 1;
+        }
+    }
+
+    if ( !loadPath.empty() )
+    {
+        // a precompiled DFA replaces the expression
+        MappedDFA mapped(loadPath);
+        std::cerr << "loaded: " << mapped.metadata() << ", states: " << mapped.view().stateCount << '\n';
+        runMatcher(Matcher(mapped.view()), argi, argc, argv, threads);
+        return 0;
+    }
+
+    if ( !patternsPath.empty() )
+    {
+        // one expression per line; every word is reported with the lines of the ones it matches
+        std::ifstream file(patternsPath);
+        if ( !file )
+        {
+            std::cerr << "Cannot open file: " << patternsPath << '\n';
+            return 1;
+        }
+        std::vector<std::string> expressions;
+        for (std::string line; std::getline(file, line);)
+        {
+            if ( !line.empty() )
+            {
+                expressions.push_back(line);
+            }
+        }
+
+        FSA *combined = FSA::parsePatterns(expressions, engine, threads);
+        if ( !exportFormat.empty() )
+        {
+            exportAutomaton(*combined, exportFormat);
+        }
+        DenseDFA dCombined(*combined, layout);
+        if ( !profilePath.empty() )
+        {
+            profileLayout(dCombined, profilePath);
+        }
+        std::cerr << "patterns: " << expressions.size() << ", dense states: " << dCombined.size() << '\n';
+        Matcher matcher(dCombined);
+        for (int i = argi; i < argc; i++)
+        {
+            auto [first, last] = matcher.matchingPatterns(argv[i]);
+            std::cout << argv[i] << ":";
+            for (const uint32_t *pattern = first; pattern != last; ++pattern)
+            {
+                std::cout << ' ' << *pattern + 1;
+            }
+            std::cout << (first == last ? " rejected\n" : "\n");
+        }
+        if ( metrics )
+        {
+            std::cerr << Metrics::current().toJSON() << '\n';
+        }
+        delete combined;
+        return 0;
+    }
+
+    if ( argc < argi + 1 )
     {
         std::cerr << "Not enough arguments" << '\n';
         return 1;
     }
 
-    std::string testExpression{argv[1]};
+    std::string testExpression{argv[argi++]};
 
     std::cerr << "testing with: " << testExpression << '\n';
 
-    NDA *test = NDA::parseExpression(testExpression);
-    test->print();
+    if ( lazy )
+    {
+        // match against the NFA, determinizing only the subsets the words reach
+        LazyDFA lazyTest = LazyDFA::parse(testExpression, engine);
+        for (int i = argi; i < argc; i++)
+        {
+            std::cout << argv[i] << ": " << (lazyTest.matches(argv[i]) ? "accepted" : "rejected") << '\n';
+        }
+        std::cerr << "cached states: " << lazyTest.cachedStates() << ", flushes: " << lazyTest.flushes() << '\n';
+        if ( metrics )
+        {
+            std::cerr << Metrics::current().toJSON() << '\n';
+        }
+        return 0;
+    }
 
-    DFA *dTest = new DFA(*test);
-    dTest->print();
+    FSA *test = FSA::parseExpression(testExpression, engine, threads);
+    if ( !exportFormat.empty() )
+    {
+        exportAutomaton(*test, exportFormat);
+    }
+
+    DenseDFA dTest(*test, layout);
+    if ( !profilePath.empty() )
+    {
+        profileLayout(dTest, profilePath);
+    }
+    std::cerr << "dense states: " << dTest.size() << ", columns: " << dTest.columns() << ", bytes: " << dTest.memoryUsage() << '\n';
 
-    MinimizedDFA *mdTest = new MinimizedDFA(*dTest);
-    mdTest->print();
+    if ( !savePath.empty() )
+    {
+        MappedDFA::save(dTest.view(), savePath, testExpression);
+    }
+
+    runMatcher(Matcher(dTest), argi, argc, argv, threads);
+
+    if ( metrics )
+    {
+        std::cerr << Metrics::current().toJSON() << '\n';
+    }
 
     delete test;
-    delete dTest;
-    delete mdTest;
 
     return 0;
 }